@@ -0,0 +1,398 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * capfile.c: reading and writing caption files in the background.
+ *
+ * Copyright 2010 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+/* When captions are in a file per image (-c with a %s), reading them
+ * happens in a worker thread rather than while an image is being
+ * shown. Asking for an image's caption also asks for the captions of
+ * the next CAPTION_READAHEAD images, so by the time they're shown,
+ * their captions are usually already in.
+ *
+ * Every result is remembered by caption filename, including "there's
+ * no such file", so no caption file is looked for more than once.
+ * A caption that arrives after its image is showing is filled in
+ * then, unless the caption has been set some other way meanwhile.
+ *
+ * Going the other way, only captions that have changed are written:
+ * MarkCaptionDirty() flags them, and every CAPTION_WRITE_SECS (and at
+ * exit) the changed ones are handed to another worker thread, which
+ * writes each file to a temporary name and renames it into place, so
+ * a crash never leaves a caption file half-written. A global caption
+ * file is rewritten as a whole if any caption in it changed.
+ */
+
+#include "pho.h"
+#include "dialogs.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/* How many images ahead to read captions for */
+#define CAPTION_READAHEAD 4
+
+/* How often to write out changed captions */
+#define CAPTION_WRITE_SECS 30
+
+typedef enum {
+    CAPTION_PENDING,
+    CAPTION_NONE,
+    CAPTION_READ
+} CaptionState;
+
+typedef struct {
+    CaptionState state;
+    char* text;
+} CaptionEntry;
+
+typedef struct {
+    PhoImage* img;
+    int index;
+    char* filename;     /* the image's, to check the slot wasn't reused */
+    char* capname;
+    char* text;         /* 0 if there was no caption file */
+} CaptionJob;
+
+/* caption filename -> CaptionEntry */
+static GHashTable* sCaptions = 0;
+
+static GThreadPool* sCaptionPool = 0;
+static int sCaptionsPending = 0;
+
+/* One file to write; text 0 means remove the file */
+typedef struct {
+    char* path;
+    char* text;
+} CaptionWrite;
+
+static GThreadPool* sWritePool = 0;
+static guint sWriteTimer = 0;
+static int sCaptionsDirty = 0;
+
+static void FreeCaptionEntry(gpointer data)
+{
+    CaptionEntry* ce = data;
+    g_free(ce->text);
+    g_free(ce);
+}
+
+/* Give img a caption, unless it got one while we were reading */
+static void ApplyCaption(PhoImage* img, const char* text)
+{
+    if (img->caption || !text)
+        return;
+    img->caption = PoolString(text);
+    FilterImageChanged(img);
+    if (img == gCurImage)
+        ShowKeywordsCaption(img);
+}
+
+/* Back in the main thread with a caption file read (or not) */
+static gboolean CaptionDone(gpointer data)
+{
+    CaptionJob* job = data;
+    CaptionEntry* ce = g_hash_table_lookup(sCaptions, job->capname);
+
+    --sCaptionsPending;
+    if (ce) {
+        ce->state = job->text ? CAPTION_READ : CAPTION_NONE;
+        ce->text = job->text;
+        job->text = 0;
+
+        if (gDebug)
+            printf("%s caption file %s\n",
+                   ce->text ? "Read" : "No", job->capname);
+
+        if (ImageAt(job->index) == job->img
+            && !strcmp(job->img->filename, job->filename))
+            ApplyCaption(job->img, ce->text);
+    }
+
+    g_free(job->filename);
+    g_free(job->capname);
+    g_free(job->text);
+    g_free(job);
+    return FALSE;
+}
+
+/* In the worker thread: read one caption file, newlines and all */
+static void ReadCaptionJob(gpointer data, gpointer user_data)
+{
+    CaptionJob* job = data;
+    char* text;
+    gsize len, i;
+
+    if (g_file_get_contents(job->capname, &text, &len, 0)) {
+        /* A caption is one line */
+        for (i = 0; i < len; ++i)
+            if (text[i] == '\n' || text[i] == '\0')
+                text[i] = ' ';
+        job->text = text;
+    }
+    g_idle_add(CaptionDone, job);
+}
+
+/* Make sure the caption for the image at index is read, or being read.
+ * Returns the entry for its caption file, or 0 if it doesn't have one.
+ */
+static CaptionEntry* RequestCaption(int index)
+{
+    PhoImage* img = ImageAt(index);
+    CaptionEntry* ce;
+    CaptionJob* job;
+    char* capname;
+
+    if (!img || !(capname = CapFileName(img)))
+        return 0;
+
+    if (!sCaptions)
+        sCaptions = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                          g_free, FreeCaptionEntry);
+    if ((ce = g_hash_table_lookup(sCaptions, capname)) != 0)
+        return ce;
+
+    ce = g_new0(CaptionEntry, 1);
+    ce->state = CAPTION_PENDING;
+    g_hash_table_insert(sCaptions, g_strdup(capname), ce);
+
+    job = g_new0(CaptionJob, 1);
+    job->img = img;
+    job->index = index;
+    job->filename = g_strdup(img->filename);
+    job->capname = g_strdup(capname);
+
+    if (!sCaptionPool)
+        sCaptionPool = g_thread_pool_new(ReadCaptionJob, 0, 1, FALSE, 0);
+    ++sCaptionsPending;
+    g_thread_pool_push(sCaptionPool, job, 0);
+    return ce;
+}
+
+/* Fill in img's caption from its caption file if that's been read
+ * already; otherwise, start reading it, and fill it in when it comes.
+ * Either way, start on the captions for the images after it.
+ */
+void LoadCaptionFile(PhoImage* img)
+{
+    int index = IndexOfImage(img);
+    int pos, i;
+    CaptionEntry* ce;
+
+    if (index < 0)
+        return;
+
+    ce = RequestCaption(index);
+    if (ce && ce->state == CAPTION_READ)
+        ApplyCaption(img, ce->text);
+
+    pos = IndexToPosition(index);
+    for (i = 0; i < CAPTION_READAHEAD; ++i) {
+        pos = NextPosition(pos);
+        if (pos < 0)
+            break;
+        RequestCaption(PositionToIndex(pos));
+    }
+}
+
+/* How many caption files are still being read */
+int CaptionsPending()
+{
+    return sCaptionsPending;
+}
+
+/* Replace path with text, or fail leaving whatever was there before.
+ * Safe to call from worker threads. Returns 0 on success.
+ */
+int WriteFileAtomically(const char* path, const char* text)
+{
+    char* tmpname = g_strdup_printf("%s.XXXXXX", path);
+    size_t len = strlen(text);
+    int fd = g_mkstemp_full(tmpname, O_WRONLY, 0666);
+    int ok, err;
+
+    if (fd < 0) {
+        err = errno;
+        g_free(tmpname);
+        errno = err;
+        return -1;
+    }
+    while (len > 0) {
+        ssize_t n = write(fd, text, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        text += n;
+        len -= n;
+    }
+
+    ok = (len == 0 && fsync(fd) == 0);
+    err = errno;
+    if (close(fd) < 0 && ok) {
+        ok = 0;
+        err = errno;
+    }
+    if (ok && rename(tmpname, path) < 0) {
+        ok = 0;
+        err = errno;
+    }
+    if (!ok)
+        unlink(tmpname);
+    g_free(tmpname);
+    errno = err;
+    return ok ? 0 : -1;
+}
+
+static void FreeCaptionWrite(gpointer data)
+{
+    CaptionWrite* cw = data;
+    g_free(cw->path);
+    g_free(cw->text);
+    g_free(cw);
+}
+
+/* In the worker thread: write one batch of caption files */
+static void WriteCaptionFiles(gpointer data, gpointer user_data)
+{
+    GPtrArray* batch = data;
+    guint i;
+
+    for (i = 0; i < batch->len; ++i) {
+        CaptionWrite* cw = g_ptr_array_index(batch, i);
+        int ret;
+
+        if (cw->text)
+            ret = WriteFileAtomically(cw->path, cw->text);
+        else if ((ret = unlink(cw->path)) < 0 && errno == ENOENT)
+            ret = 0;
+
+        if (ret < 0)
+            fprintf(stderr, "Couldn't save caption in %s: %s\n",
+                    cw->path, strerror(errno));
+        else if (gDebug)
+            printf("Wrote caption file %s\n", cw->path);
+    }
+    g_ptr_array_free(batch, TRUE);
+}
+
+static void AddCaptionWrite(GPtrArray* batch, const char* path,
+                            const char* text)
+{
+    CaptionWrite* cw = g_new0(CaptionWrite, 1);
+    cw->path = g_strdup(path);
+    cw->text = g_strdup(text);
+    g_ptr_array_add(batch, cw);
+}
+
+static gboolean CaptionWriteTimer(gpointer data)
+{
+    sWriteTimer = 0;
+    WriteCaptions();
+    return FALSE;
+}
+
+/* img's caption has changed, and should be saved */
+void MarkCaptionDirty(PhoImage* img)
+{
+    if (!img || img->captionDirty)
+        return;
+    img->captionDirty = 1;
+    ++sCaptionsDirty;
+    if (!sWriteTimer)
+        sWriteTimer = g_timeout_add_seconds(CAPTION_WRITE_SECS,
+                                            CaptionWriteTimer, 0);
+}
+
+/* Hand every changed caption to the writer thread */
+void WriteCaptions()
+{
+    GPtrArray* batch;
+    GString* global = 0;
+    int index, any = 0;
+
+    if (sWriteTimer) {
+        g_source_remove(sWriteTimer);
+        sWriteTimer = 0;
+    }
+    if (!sCaptionsDirty || !gCapFileFormat)
+        return;
+
+    batch = g_ptr_array_new_with_free_func(FreeCaptionWrite);
+    if (GlobalCaptionFile())
+        global = g_string_new("");
+
+    for (index = 0; index < gNumImages; ++index) {
+        PhoImage* img = ImageAt(index);
+        const char* caption;
+
+        if (!img)
+            continue;
+        caption = img->caption;
+
+        if (global) {
+            /* The whole file gets written, so include captions from
+             * it for images that haven't been shown yet.
+             */
+            if (!caption)
+                caption = IndexedCaption(img->filename);
+            if (caption && *caption)
+                g_string_append_printf(global, "%s: %s\n\n",
+                                       img->filename, caption);
+            any |= img->captionDirty;
+        }
+        else if (img->captionDirty) {
+            char* capname = CapFileName(img);
+            CaptionEntry* ce;
+
+            if (capname) {
+                /* An emptied caption means no caption file */
+                const char* text = (caption && *caption) ? caption : 0;
+                AddCaptionWrite(batch, capname, text);
+
+                /* Keep what's cached in step with the file */
+                if (sCaptions
+                    && (ce = g_hash_table_lookup(sCaptions, capname))) {
+                    g_free(ce->text);
+                    ce->text = g_strdup(text);
+                    ce->state = text ? CAPTION_READ : CAPTION_NONE;
+                }
+            }
+        }
+        img->captionDirty = 0;
+    }
+    sCaptionsDirty = 0;
+
+    if (global) {
+        if (any)
+            AddCaptionWrite(batch, gCapFileFormat, global->str);
+        g_string_free(global, TRUE);
+    }
+
+    if (batch->len == 0) {
+        g_ptr_array_free(batch, TRUE);
+        return;
+    }
+    if (!sWritePool)
+        sWritePool = g_thread_pool_new(WriteCaptionFiles, 0, 1, FALSE, 0);
+    g_thread_pool_push(sWritePool, batch, 0);
+}
+
+/* Write any changed captions and wait until they're all written,
+ * e.g. at exit.
+ */
+void FinishCaptionWrites()
+{
+    WriteCaptions();
+    if (sWritePool) {
+        g_thread_pool_free(sWritePool, FALSE, TRUE);
+        sWritePool = 0;
+    }
+}
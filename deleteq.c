@@ -0,0 +1,282 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * deleteq.c: deleting image files in the background, with undo.
+ *
+ * Copyright 2010 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+/* Deleting an image only marks it deleted and takes it out of the
+ * image list, so pho can go straight on to the next image. The files
+ * themselves are deleted (or moved to gTrashDir, if set) in batches
+ * by a worker thread, once DELETE_COMMIT_SECS have gone by with no
+ * more deletes, so a slow filesystem never holds up the display.
+ * Until its batch goes, UndoDelete() puts the latest deleted image
+ * back where it was.
+ *
+ * An image's own XMP sidecar (with --xmp) and caption file (with a
+ * per-image -c format) go with it, to the trash or away, but only once
+ * the image itself has gone; until then, nothing has been touched, so
+ * undoing a delete brings back all of them.
+ */
+
+#include "pho.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* Seconds to wait for more deletes (or an undo) before deleting files */
+#define DELETE_COMMIT_SECS 10
+
+/* Don't let more than this many deletes pile up */
+#define DELETE_BATCH_MAX 100
+
+/* If set, move deleted files here instead of unlinking them */
+char* gTrashDir = 0;
+
+typedef struct {
+    PhoImage* img;
+    int index;
+    char* filename;     /* our own copy, for the worker thread */
+    char* sidecar;      /* its XMP sidecar, or 0 */
+    char* capfile;      /* its caption file, or 0 */
+    int generation;
+    int failed;
+} PendingDelete;
+
+/* Deletes waiting to be committed, oldest first */
+static GPtrArray* sPending = 0;
+static guint sCommitTimer = 0;
+
+static GThreadPool* sDeletePool = 0;
+
+/* Bumped when the image list is cleared, since img and index
+ * in older PendingDeletes no longer mean anything.
+ */
+static int sListGeneration = 0;
+
+static void FreePendingDelete(PendingDelete* pd)
+{
+    g_free(pd->filename);
+    g_free(pd->sidecar);
+    g_free(pd->capfile);
+    g_free(pd);
+}
+
+/* Move filename into gTrashDir, as base (or its own name, if base
+ * is 0), picking a new name if there's already a file by that name
+ * there. If moved isn't 0, it gets the new path. Returns 0 on success.
+ */
+static int MoveToTrash(const char* filename, const char* base, char** moved)
+{
+    char* name = base ? g_strdup(base) : g_path_get_basename(filename);
+    char* dest = g_build_filename(gTrashDir, name, NULL);
+    struct stat st;
+    int i, ret, err;
+
+    for (i = 1; lstat(dest, &st) == 0; ++i) {
+        g_free(dest);
+        dest = g_strdup_printf("%s/%s.%d", gTrashDir, name, i);
+    }
+    ret = rename(filename, dest);
+    err = errno;
+    if (ret < 0 && err == EXDEV)
+        fprintf(stderr, "%s isn't on the same filesystem as %s\n",
+                filename, gTrashDir);
+
+    g_free(name);
+    if (moved && ret == 0)
+        *moved = dest;
+    else
+        g_free(dest);
+    errno = err;
+    return ret;
+}
+
+/* Delete (or move to the trash, as base) a file that goes with
+ * an image. It's fine for it not to be there.
+ */
+static void DeleteCompanion(const char* filename, const char* base)
+{
+    int ret;
+
+    if (!filename)
+        return;
+    ret = gTrashDir ? MoveToTrash(filename, base, 0) : unlink(filename);
+    if (ret < 0 && errno != ENOENT)
+        printf("OOPS!  Can't delete %s: %s\n", filename, strerror(errno));
+    else if (ret == 0 && gDebug)
+        printf("Deleted %s\n", filename);
+}
+
+/* Back in the main thread: put back any images whose files
+ * couldn't be deleted, if their slots haven't been reused.
+ */
+static gboolean DeletesDone(gpointer data)
+{
+    GPtrArray* batch = data;
+    guint i;
+
+    for (i = 0; i < batch->len; ++i) {
+        PendingDelete* pd = g_ptr_array_index(batch, i);
+        if (pd->failed && pd->generation == sListGeneration
+            && pd->index < gNumImages && !ImageAt(pd->index)) {
+            pd->img->deleted = 0;
+            RestoreItem(pd->img, pd->index);
+        }
+    }
+    g_ptr_array_free(batch, TRUE);
+    return FALSE;
+}
+
+/* In the worker thread: delete one batch of files */
+static void DeleteFiles(gpointer data, gpointer user_data)
+{
+    GPtrArray* batch = data;
+    int anyFailed = 0;
+    guint i;
+
+    for (i = 0; i < batch->len; ++i) {
+        PendingDelete* pd = g_ptr_array_index(batch, i);
+        char* moved = 0;
+        int ret = gTrashDir ? MoveToTrash(pd->filename, 0, &moved)
+                            : unlink(pd->filename);
+        if (ret < 0) {
+            printf("OOPS!  Can't delete %s: %s\n",
+                   pd->filename, strerror(errno));
+            pd->failed = anyFailed = 1;
+        }
+        else {
+            if (gDebug)
+                printf("Deleted %s\n", pd->filename);
+            /* The sidecar keeps the image's name in the trash */
+            if (moved) {
+                char* base = g_path_get_basename(moved);
+                char* sidecar = g_strdup_printf("%s.xmp", base);
+                DeleteCompanion(pd->sidecar, sidecar);
+                g_free(sidecar);
+                g_free(base);
+                g_free(moved);
+            }
+            else
+                DeleteCompanion(pd->sidecar, 0);
+            DeleteCompanion(pd->capfile, 0);
+        }
+    }
+
+    if (anyFailed)
+        g_idle_add(DeletesDone, batch);
+    else
+        g_ptr_array_free(batch, TRUE);
+}
+
+/* Hand everything pending to the worker; it can't be undone after this */
+void CommitDeletes()
+{
+    if (sCommitTimer) {
+        g_source_remove(sCommitTimer);
+        sCommitTimer = 0;
+    }
+    if (!sPending || sPending->len == 0)
+        return;
+
+    if (!sDeletePool)
+        sDeletePool = g_thread_pool_new(DeleteFiles, 0, 1, FALSE, 0);
+    g_thread_pool_push(sDeletePool, sPending, 0);
+    sPending = 0;
+}
+
+static gboolean CommitTimer(gpointer data)
+{
+    sCommitTimer = 0;
+    CommitDeletes();
+    return FALSE;
+}
+
+/* Delete img's file, soon: take it out of the list right away,
+ * but leave time to change our minds.
+ */
+void QueueDelete(PhoImage* img)
+{
+    PendingDelete* pd;
+    char* capname;
+    int index = IndexOfImage(img);
+
+    if (index < 0 || img->deleted)
+        return;
+
+    pd = g_new0(PendingDelete, 1);
+    pd->img = img;
+    pd->index = index;
+    pd->filename = g_strdup(img->filename);
+    if (gUseXmp)
+        pd->sidecar = g_strdup_printf("%s.xmp", img->filename);
+    if (gCapFileFormat && !GlobalCaptionFile()
+        && (capname = CapFileName(img)) != 0)
+        pd->capfile = g_strdup(capname);
+    pd->generation = sListGeneration;
+
+    if (!sPending)
+        sPending = g_ptr_array_new_with_free_func((GDestroyNotify)
+                                                  FreePendingDelete);
+    g_ptr_array_add(sPending, pd);
+
+    img->deleted = 1;
+    DeleteItem(img);
+
+    if (sCommitTimer)
+        g_source_remove(sCommitTimer);
+    sCommitTimer = 0;
+    if (sPending->len >= DELETE_BATCH_MAX)
+        CommitDeletes();
+    else
+        sCommitTimer = g_timeout_add_seconds(DELETE_COMMIT_SECS,
+                                             CommitTimer, 0);
+}
+
+/* Bring back the most recently deleted image, if its file hasn't
+ * been deleted yet, and make it the current image.
+ * Returns 0 on success, -1 if there's nothing to undo.
+ */
+int UndoDelete()
+{
+    PendingDelete* pd;
+
+    if (!sPending || sPending->len == 0)
+        return -1;
+
+    pd = g_ptr_array_index(sPending, sPending->len - 1);
+    if (gDebug)
+        printf("Undeleting %s\n", pd->filename);
+    pd->img->deleted = 0;
+    RestoreItem(pd->img, pd->index);
+    SetCurrentImage(pd->index);
+    g_ptr_array_remove_index(sPending, sPending->len - 1);
+
+    if (sPending->len == 0 && sCommitTimer) {
+        g_source_remove(sCommitTimer);
+        sCommitTimer = 0;
+    }
+    return 0;
+}
+
+/* The image list is being cleared: nothing can be undone any more. */
+void ForgetDeletes()
+{
+    CommitDeletes();
+    ++sListGeneration;
+}
+
+/* Delete everything pending and wait until it's done, e.g. at exit. */
+void FinishDeletes()
+{
+    CommitDeletes();
+    if (sDeletePool) {
+        g_thread_pool_free(sDeletePool, FALSE, TRUE);
+        sDeletePool = 0;
+    }
+}
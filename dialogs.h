@@ -22,6 +22,7 @@ extern void HideKeywordsDialog();
 extern void UpdateKeywordsDialog();
 extern void RememberKeywords();
 extern void NoCurrentKeywords();   /* use when deleting current image */
+extern void ShowKeywordsCaption(PhoImage* img);
 
 /* A function dialogs must call to stay on top of the image window */
 extern void KeepOnTop(GtkWidget* dialog);
@@ -0,0 +1,418 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * dirscan.c: find the images under directories given to pho.
+ *
+ * Copyright 2010 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+/* Directories are walked by a pool of worker threads, one directory
+ * per task: a worker queues each subdirectory it finds as a new task,
+ * so big trees are read in parallel. A task holds only the path, and
+ * the directory isn't opened until the task runs, so however wide the
+ * tree, only as many directories are open as there are workers.
+ *
+ * A file is an image if its extension is one gdk-pixbuf knows about,
+ * or, failing that, if its first few bytes look like an image.
+ *
+ * Workers never touch the image list. Each directory's listing, its
+ * images and subdirectories, is sorted and handed back to the main
+ * loop, which adds images in the order of their full paths, whatever
+ * order the workers finish in: an image is added as soon as every
+ * directory that sorts before it has been read. So the list comes out
+ * the same on every run (and so does a seeded shuffle of it), and the
+ * first image can still be shown long before the walk is finished.
+ */
+
+#include "pho.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+/* How often the main loop picks up directories that have been read,
+ * in milliseconds
+ */
+#define DIRSCAN_POLL_MILLIS 50
+
+/* A directory to read. A worker fills in its entries, then hands it
+ * back through sReadQueue. Only the main thread frees it, once it's
+ * come back and nothing refers to it.
+ */
+typedef struct {
+    char* path;
+    int generation;
+    GPtrArray* entries;     /* DirEntry*, sorted; 0 if it couldn't be read */
+    int read;               /* it's come back */
+    int refs;               /* main thread only */
+} DirNode;
+
+/* One thing in a directory: an image, or a subdirectory */
+typedef struct {
+    char* image;
+    DirNode* dir;
+} DirEntry;
+
+static GThreadPool* sScanPool = 0;
+static GAsyncQueue* sReadQueue = 0;
+static guint sPollSource = 0;
+
+/* What's still to be added, last entry first: images, and directories
+ * whose entries go in their place once they've been read.
+ */
+static GPtrArray* sToAdd = 0;
+
+/* Pushed to sReadQueue to wake WaitForDirScans() when the walk is done */
+static DirNode sWakeup;
+
+/* Directories queued or being read */
+static gint sPendingDirs = 0;
+
+/* Bumped by CancelDirScans(), so old tasks and batches get dropped */
+static gint sGeneration = 0;
+
+/* Lowercase extensions gdk-pixbuf can load; read-only once set up */
+static char** sImageExtensions = 0;
+
+/* Set up the list of image extensions. Call from the main thread
+ * before any IsImageFile() calls.
+ */
+void InitImageTypes()
+{
+    GSList *formats, *cur;
+    GPtrArray* exts;
+
+    if (sImageExtensions)
+        return;
+
+    exts = g_ptr_array_new();
+
+    formats = gdk_pixbuf_get_formats();
+    for (cur = formats; cur; cur = cur->next) {
+        gchar** fmtexts = gdk_pixbuf_format_get_extensions(cur->data);
+        int i;
+        for (i = 0; fmtexts && fmtexts[i]; ++i)
+            g_ptr_array_add(exts, g_ascii_strdown(fmtexts[i], -1));
+        g_strfreev(fmtexts);
+    }
+    g_slist_free(formats);
+
+    g_ptr_array_add(exts, 0);
+    sImageExtensions = (char**)g_ptr_array_free(exts, FALSE);
+}
+
+static int HasImageExtension(const char* name)
+{
+    const char* dot = strrchr(name, '.');
+    int i;
+
+    if (!dot || !dot[1])
+        return 0;
+    for (i = 0; sImageExtensions[i]; ++i)
+        if (!strcasecmp(dot + 1, sImageExtensions[i]))
+            return 1;
+    return 0;
+}
+
+/* Does the start of a file look like one of the common image formats? */
+int LooksLikeImage(const unsigned char* buf, size_t len)
+{
+    if (len >= 3 && buf[0] == 0xff && buf[1] == 0xd8 && buf[2] == 0xff)
+        return 1;                                   /* JPEG */
+    if (len >= 8 && !memcmp(buf, "\x89PNG\r\n\x1a\n", 8))
+        return 1;                                   /* PNG */
+    if (len >= 4 && !memcmp(buf, "GIF8", 4))
+        return 1;
+    if (len >= 4 && (!memcmp(buf, "II*\0", 4) || !memcmp(buf, "MM\0*", 4)))
+        return 1;                                   /* TIFF */
+    if (len >= 2 && buf[0] == 'B' && buf[1] == 'M')
+        return 1;                                   /* BMP */
+    if (len >= 12 && !memcmp(buf, "RIFF", 4) && !memcmp(buf + 8, "WEBP", 4))
+        return 1;
+    return 0;
+}
+
+/* Is name (relative to dirfd) a file we should try to show? */
+int IsImageFile(int dirfd, const char* name)
+{
+    unsigned char buf[16];
+    ssize_t len;
+    int fd;
+
+    if (HasImageExtension(name))
+        return 1;
+
+    fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+    if (fd < 0)
+        return 0;
+    len = read(fd, buf, sizeof buf);
+    close(fd);
+    return len > 0 && LooksLikeImage(buf, len);
+}
+
+/* Directories sort as if their names ended in '/', so that images
+ * come out in the order of their full paths.
+ */
+static gint CompareEntries(gconstpointer a, gconstpointer b)
+{
+    const DirEntry* ea = *(DirEntry* const*)a;
+    const DirEntry* eb = *(DirEntry* const*)b;
+    const unsigned char* pa = (const unsigned char*)
+        (ea->image ? ea->image : ea->dir->path);
+    const unsigned char* pb = (const unsigned char*)
+        (eb->image ? eb->image : eb->dir->path);
+
+    while (*pa && *pa == *pb)
+        ++pa, ++pb;
+    return (*pa ? *pa : ea->dir ? '/' : 0) - (*pb ? *pb : eb->dir ? '/' : 0);
+}
+
+static void UnrefDirNode(DirNode* node);    /* forward */
+
+static void FreeDirEntry(DirEntry* entry)
+{
+    g_free(entry->image);
+    if (entry->dir)
+        UnrefDirNode(entry->dir);
+    g_free(entry);
+}
+
+static void UnrefDirNode(DirNode* node)
+{
+    guint i;
+
+    if (--node->refs > 0)
+        return;
+    if (node->entries) {
+        for (i = 0; i < node->entries->len; ++i)
+            FreeDirEntry(g_ptr_array_index(node->entries, i));
+        g_ptr_array_free(node->entries, TRUE);
+    }
+    g_free(node->path);
+    g_free(node);
+}
+
+/* A new directory to read. It starts with two references: one for
+ * the task, dropped when it comes back, and one for whoever will
+ * add its images.
+ */
+static DirNode* QueueDir(char* path, int generation)
+{
+    DirNode* node = g_new0(DirNode, 1);
+    node->path = path;
+    node->generation = generation;
+    node->refs = 2;
+    g_atomic_int_inc(&sPendingDirs);
+    g_thread_pool_push(sScanPool, node, 0);
+    return node;
+}
+
+static DirEntry* NewDirEntry(char* image, DirNode* dir)
+{
+    DirEntry* entry = g_new(DirEntry, 1);
+    entry->image = image;
+    entry->dir = dir;
+    return entry;
+}
+
+/* Read one directory: queue its subdirectories as new tasks, and hand
+ * it back to the main loop with its images and subdirectories sorted.
+ */
+static void ScanDir(gpointer data, gpointer user_data)
+{
+    DirNode* task = data;
+    GPtrArray* entries;
+    struct dirent* ent;
+    DIR* dir;
+    int fd;
+
+    if (task->generation != g_atomic_int_get(&sGeneration))
+        goto done;
+
+    fd = open(task->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || !(dir = fdopendir(fd))) {
+        perror(task->path);
+        if (fd >= 0)
+            close(fd);
+        goto done;
+    }
+
+    entries = g_ptr_array_new();
+    while ((ent = readdir(dir)) != 0) {
+        int isdir = 0, isreg = 0;
+        char* path;
+
+        /* Skip . and .., and hidden files and directories like .thumbnails */
+        if (ent->d_name[0] == '.')
+            continue;
+
+        if (ent->d_type == DT_DIR)
+            isdir = 1;
+        else if (ent->d_type == DT_REG)
+            isreg = 1;
+        else if (ent->d_type == DT_UNKNOWN || ent->d_type == DT_LNK) {
+            /* Follow links to files, but not to directories,
+             * so a link loop can't make the walk go on forever.
+             */
+            struct stat st;
+            int islink;
+            if (fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+                continue;
+            islink = S_ISLNK(st.st_mode);
+            if (islink && fstatat(fd, ent->d_name, &st, 0) < 0)
+                continue;
+            isdir = S_ISDIR(st.st_mode) && !islink;
+            isreg = S_ISREG(st.st_mode);
+        }
+
+        if (isdir) {
+            path = g_build_filename(task->path, ent->d_name, NULL);
+            g_ptr_array_add(entries,
+                            NewDirEntry(0, QueueDir(path, task->generation)));
+        }
+        else if (isreg && IsImageFile(fd, ent->d_name))
+            g_ptr_array_add(entries, NewDirEntry(g_build_filename(task->path,
+                                                                  ent->d_name,
+                                                                  NULL), 0));
+    }
+    closedir(dir);
+
+    g_ptr_array_sort(entries, CompareEntries);
+    task->entries = entries;
+
+  done:
+    g_async_queue_push(sReadQueue, task);
+
+    /* Wake up anyone waiting in WaitForDirScans() */
+    if (g_atomic_int_dec_and_test(&sPendingDirs))
+        g_async_queue_push(sReadQueue, &sWakeup);
+}
+
+/* Add every image that's next in line and whose directory has been
+ * read. Returns the number of images added.
+ */
+static int AddReadImages()
+{
+    int added = 0;
+
+    while (sToAdd && sToAdd->len > 0) {
+        DirEntry* entry = g_ptr_array_index(sToAdd, sToAdd->len - 1);
+        DirNode* node = entry->dir;
+        guint i;
+
+        if (node && !node->read)
+            break;
+        g_ptr_array_set_size(sToAdd, sToAdd->len - 1);
+
+        if (entry->image) {
+            AddImage(entry->image);
+            ++added;
+        }
+        else if (node->entries) {
+            /* Its entries take its place */
+            for (i = node->entries->len; i > 0; --i)
+                g_ptr_array_add(sToAdd,
+                                g_ptr_array_index(node->entries, i - 1));
+            g_ptr_array_free(node->entries, TRUE);
+            node->entries = 0;
+        }
+        FreeDirEntry(entry);
+    }
+    return added;
+}
+
+/* Back in the main thread with a directory that's been read (or the
+ * wakeup). Returns the number of images that could then be added.
+ */
+static int DirRead(DirNode* node)
+{
+    if (node == &sWakeup)
+        return 0;
+    node->read = 1;
+    UnrefDirNode(node);
+    return AddReadImages();
+}
+
+/* Is any directory still being read, or waiting to be taken in? */
+int DirScansPending()
+{
+    return sReadQueue && (g_atomic_int_get(&sPendingDirs) > 0
+                          || g_async_queue_length(sReadQueue) > 0);
+}
+
+static gboolean PollDirScans(gpointer data)
+{
+    DirNode* node;
+
+    while ((node = g_async_queue_try_pop(sReadQueue)) != 0)
+        DirRead(node);
+
+    if (DirScansPending())
+        return TRUE;
+    sPollSource = 0;
+    if (gDebug)
+        printf("Finished reading directories: %d images\n", CountImages());
+    return FALSE;
+}
+
+/* Start adding the images under dirname to the end of the image list.
+ * They'll be appended from the main loop as they're found.
+ */
+void AddDirectory(const char* dirname)
+{
+    if (!sScanPool) {
+        int nthreads = g_get_num_processors();
+        InitImageTypes();
+        sReadQueue = g_async_queue_new();
+        sToAdd = g_ptr_array_new();
+        sScanPool = g_thread_pool_new(ScanDir, 0,
+                                      nthreads > 1 ? nthreads : 2,
+                                      FALSE, 0);
+    }
+
+    if (gDebug)
+        printf("Scanning directory %s\n", dirname);
+
+    /* Its images go after any still waiting to be added */
+    g_ptr_array_insert(sToAdd, 0,
+                       NewDirEntry(0, QueueDir(g_strdup(dirname),
+                                               g_atomic_int_get(&sGeneration))));
+
+    if (!sPollSource)
+        sPollSource = g_timeout_add(DIRSCAN_POLL_MILLIS, PollDirScans, 0);
+}
+
+/* Wait for directory scans to add images: until everything has been
+ * read if all is set, else until at least one image has been added
+ * (or there's nothing left to read).
+ * Returns the number of images added.
+ */
+int WaitForDirScans(int all)
+{
+    int added = 0;
+
+    while (DirScansPending() && (all || added == 0))
+        added += DirRead(g_async_queue_pop(sReadQueue));
+    return added;
+}
+
+/* Forget about any directories still being read, e.g. because
+ * the image list is being replaced.
+ */
+void CancelDirScans()
+{
+    guint i;
+
+    g_atomic_int_inc(&sGeneration);
+    if (!sToAdd)
+        return;
+    for (i = 0; i < sToAdd->len; ++i)
+        FreeDirEntry(g_ptr_array_index(sToAdd, i));
+    g_ptr_array_set_size(sToAdd, 0);
+}
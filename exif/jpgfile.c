@@ -180,6 +180,9 @@ int ReadJpegSections (FILE * infile, ReadMode_t ReadMode)
             ErrFatal("Could not allocate memory");
         }
         Sections[SectionsRead].Data = Data;
+        // Count the section now, so DiscardData() frees it even if
+        // ErrFatal() doesn't exit (as in the fuzzing harness).
+        SectionsRead += 1;
 
         // Store first two pre-read bytes.
         Data[0] = (uchar)lh;
@@ -189,7 +192,6 @@ int ReadJpegSections (FILE * infile, ReadMode_t ReadMode)
         if (got != itemlen-2){
             ErrFatal("Premature end of file?");
         }
-        SectionsRead += 1;
 
         switch(marker){
 
@@ -45,9 +45,11 @@ void KeepOnTop(GtkWidget* dialog)
 
 static void AddComment(PhoImage* img, char* txt)
 {
-    if (img->comment != 0)
-        free(img->comment);
-    img->comment = strdup(txt);
+    /* Pooled strings aren't freed, so don't copy one that's unchanged */
+    if (img->comment && !strcmp(img->comment, txt))
+        return;
+    img->comment = PoolString(txt);
+    JournalComment(img);
 }
 
 /* Update the image according to whatever has changed in the dialog.
@@ -57,7 +59,6 @@ static void AddComment(PhoImage* img, char* txt)
 static void UpdateImage()
 {
     int i;
-    unsigned mask, flags;
     char* text;
 
     if (!InfoDialog || !gtk_widget_get_visible(InfoDialog)
@@ -68,13 +69,11 @@ static void UpdateImage()
     if (text && *text)
         AddComment(sCurInfoImage, text);
             
-    flags = 0;
-    for (i=0, mask=1; i<10; ++i, mask <<= 1)
-    {
-        if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(InfoFlag[i])))
-            flags |= mask;
-    }
-    sCurInfoImage->noteFlags = flags;
+    /* The dialog only shows notes 0-9, so leave any others alone */
+    for (i=0; i<10; ++i)
+        SetNote(sCurInfoImage, i,
+                gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(InfoFlag[i])));
+    FilterImageChanged(sCurInfoImage);
 }
 
 static void PopdownInfoDialog()
@@ -86,7 +85,7 @@ static void PopdownInfoDialog()
 
 void SetInfoDialogToggle(int which, int newval)
 {
-    if (InfoFlag[which])
+    if (which >= 0 && which < 10 && InfoFlag[which])
         gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(InfoFlag[which]),
                                      newval ? TRUE : FALSE);
 }
@@ -95,7 +94,7 @@ void UpdateInfoDialog()
 {
     char buffer[256];
     char* s;
-    int i, mask, flags;
+    int i;
 
     if (!gCurImage || !InfoDialog || !gtk_widget_get_visible(InfoDialog))
         /* Don't need to check whether it's visible -- if we're not
@@ -155,9 +154,8 @@ void UpdateInfoDialog()
     }
 
     /* Update the flags buttons */
-    flags = gCurImage->noteFlags;
-    for (i=0, mask=1; i<10; ++i, mask <<= 1)
-        SetInfoDialogToggle(i, (flags & mask) != 0);
+    for (i=0; i<10; ++i)
+        SetInfoDialogToggle(i, HasNote(gCurImage, i));
 
     /* Loop over the various EXIF elements.
      * Expect we already called ExifReadInfo, back in LoadImageFromFile.
@@ -505,10 +503,125 @@ int Prompt(char* msg, char* yesStr, char* noStr, char* yesChars, char* noChars)
     return qYesNo;
 }
 
+/*
+ * Ask for a line of text, in a dialog shared by the prompts below.
+ * Returns a newly allocated string, or 0 if the user cancelled.
+ */
+static char* PromptForText(const char* title, const char* msg,
+                           const char* initial)
+{
+    static GtkWidget* textDialog = 0;
+    static GtkWidget* textLabel = 0;
+    static GtkWidget* textEntry = 0;
+    char* text;
+
+    if (!textDialog)
+    {
+        GtkWidget* content;
+
+        textDialog = gtk_dialog_new_with_buttons(title,
+                                                 GTK_WINDOW(gWin),
+                                                 GTK_DIALOG_MODAL,
+                                                 GTK_STOCK_OK, 1,
+                                                 GTK_STOCK_CANCEL, 0,
+                                                 NULL);
+        KeepOnTop(textDialog);
+        gtk_dialog_set_default_response(GTK_DIALOG(textDialog), 1);
+
+        content = gtk_dialog_get_content_area(GTK_DIALOG(textDialog));
+        textLabel = gtk_label_new("");
+        gtk_box_pack_start(GTK_BOX(content), textLabel, TRUE, TRUE, 8);
+        gtk_widget_show(textLabel);
+
+        textEntry = gtk_entry_new();
+        /* Enter in the entry means OK */
+        gtk_entry_set_activates_default(GTK_ENTRY(textEntry), TRUE);
+        gtk_box_pack_start(GTK_BOX(content), textEntry, TRUE, TRUE, 8);
+        gtk_widget_show(textEntry);
+    }
+
+    gtk_window_set_title(GTK_WINDOW(textDialog), title);
+    gtk_label_set_text(GTK_LABEL(textLabel), msg);
+    gtk_entry_set_text(GTK_ENTRY(textEntry), initial ? initial : "");
+    gtk_widget_grab_focus(textEntry);
+
+    gtk_widget_show(textDialog);
+    if (gtk_dialog_run(GTK_DIALOG(textDialog)) != 1) {
+        gtk_widget_hide(textDialog);
+        return 0;
+    }
+    text = g_strdup(gtk_entry_get_text(GTK_ENTRY(textEntry)));
+    gtk_widget_hide(textDialog);
+    return text;
+}
+
+/*
+ * Ask for an image position (number or percentage) and jump there.
+ */
+void PromptGotoImage()
+{
+    char msg[128];
+    char* text;
+    int index;
+
+    if (CountImages() == 0)
+        return;
+
+    snprintf(msg, sizeof msg,
+             "Go to image (1-%d, or a percentage like 50%%):",
+             CountImages());
+    text = PromptForText("Go to image", msg, 0);
+    if (!text)
+        return;
+    index = ParseImagePosition(text);
+    g_free(text);
+
+    if (index < 0) {
+        gdk_beep();
+        return;
+    }
+    GotoImage(index);
+}
+
+/*
+ * Ask for a filter expression, and show only the images that match it.
+ */
+void PromptImageFilter()
+{
+    char *text, *oldFilter;
+    int n;
+
+    text = PromptForText("Filter images",
+                         "Show only images matching (empty for all),\n"
+                         "e.g. \"3 !rotated, portrait caption\":",
+                         ImageFilter());
+    if (!text)
+        return;
+    oldFilter = g_strdup(ImageFilter());
+    n = SetImageFilter(text);
+    g_free(text);
+
+    /* A typo, or nothing matches: say so, and keep the old filter */
+    if (n == 0)
+        SetImageFilter(oldFilter);
+    g_free(oldFilter);
+    if (n <= 0) {
+        gdk_beep();
+        return;
+    }
+
+    /* Stay on the current image if it matches, else find one that does */
+    if (gCurImage && FilterRank(CurrentPosition()) >= 0)
+        ShowImage();
+    else
+        GotoImage(CurrentPosition());
+}
+
 static void SetNewFiles(GtkWidget *dialog, gint res)
 {
 	GSList *files, *cur;
     gboolean overwrite;
+    int firstNew;
 
     if (res == GTK_RESPONSE_ACCEPT)
         overwrite = FALSE;
@@ -521,24 +634,32 @@ static void SetNewFiles(GtkWidget *dialog, gint res)
 
     files = cur = gtk_file_chooser_get_filenames(GTK_FILE_CHOOSER(dialog));
 
-    if (overwrite)
+    if (overwrite) {
+        CancelDirScans();
         ClearImageList();
+    }
 
-    gCurImage = 0;
+    /* The first of the new images will be at the end of the list */
+    firstNew = gNumImages;
 
     while (cur)
     {
-        PhoImage* img = AddImage((char*)(cur->data));
-        if (!gCurImage)
-            gCurImage = img;
-
+        if (g_file_test((char*)(cur->data), G_FILE_TEST_IS_DIR))
+            AddDirectory((char*)(cur->data));
+        else
+            AddImage((char*)(cur->data));
         cur = cur->next;
     }
-    if (files)
-        g_slist_free (files);
+    /* AddImage() and AddDirectory() made their own copies */
+    g_slist_free_full(files, g_free);
 
     gtk_widget_destroy (dialog);
 
+    /* If only folders were chosen, wait for the first image in them */
+    if (gNumImages == firstNew)
+        WaitForDirScans(0);
+
+    SetCurrentImage(firstNew);
     ThisImage();
 }
 
@@ -17,12 +17,35 @@
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
 
 char * gCapFileFormat = "Captions";
 
 /* randomize order in which images will be shown? */
 int gRandomOrder = 0;
 
+/* Seed for the random order, if one was given with --seed */
+static unsigned int sRandomSeed = 0;
+static int sHaveRandomSeed = 0;
+
+/* Position to start at, from --session, or -1 if not resuming */
+static int sResumePos = -1;
+
+static void SetRandomSeed(char* str)
+{
+    char* end;
+
+    if (!str || !*str)
+        Usage();
+    sRandomSeed = strtoul(str, &end, 0);
+    if (*end)
+        Usage();
+    sHaveRandomSeed = 1;
+    gRandomOrder = 1;
+}
+
 /* Toggle a variable between two modes, preferring the first.
  * If it's anything but mode1 it will end up as mode1.
  */
@@ -191,6 +214,12 @@ gint HandleGlobalKeys(GtkWidget* widget, GdkEventKey* event)
           if (gCurImage)
               DeleteImage(gCurImage);
           break;
+      case GDK_KEY_u:   /* Undelete, if the file is still there */
+          if (UndoDelete() == 0)
+              ThisImage();
+          else
+              gdk_beep();
+          return TRUE;
       case GDK_KEY_space:
       case GDK_KEY_Page_Down:
       case GDK_KEY_KP_Page_Down:
@@ -209,12 +238,18 @@ gint HandleGlobalKeys(GtkWidget* widget, GdkEventKey* event)
           PrevImage();
           return TRUE;
       case GDK_KEY_Home:
-          gCurImage = 0;
+          SetCurrentImage(-1);
           NextImage();
           return TRUE;
       case GDK_KEY_End:
-          gCurImage = gFirstImage->prev;
-          ThisImage();
+          SetCurrentImage(-1);
+          PrevImage();
+          return TRUE;
+      case GDK_KEY_j:   /* Jump to an image by number or percentage */
+          PromptGotoImage();
+          return TRUE;
+      case GDK_KEY_v:   /* Show only images matching a filter */
+          PromptImageFilter();
           return TRUE;
       case GDK_KEY_n:   /* Get out of any weird display modes */
           SetViewModes(PHO_DISPLAY_NORMAL, PHO_SCALE_NORMAL, 1.);
@@ -255,6 +290,8 @@ gint HandleGlobalKeys(GtkWidget* widget, GdkEventKey* event)
       case GDK_KEY_Right:
       case GDK_KEY_KP_Right:
           ScaleAndRotate(gCurImage, 90);
+          JournalRotation(gCurImage);
+          MarkXmpDirty(gCurImage);
           return TRUE;
       case GDK_KEY_T:   /* make life easier for xv users */
       case GDK_KEY_R:
@@ -263,10 +300,14 @@ gint HandleGlobalKeys(GtkWidget* widget, GdkEventKey* event)
       case GDK_KEY_Left:
       case GDK_KEY_KP_Left:
           ScaleAndRotate(gCurImage, 270);
+          JournalRotation(gCurImage);
+          MarkXmpDirty(gCurImage);
           return TRUE;
       case GDK_KEY_Up:
       case GDK_KEY_Down:
           ScaleAndRotate(gCurImage, 180);
+          JournalRotation(gCurImage);
+          MarkXmpDirty(gCurImage);
           return TRUE;
       case GDK_KEY_plus:
       case GDK_KEY_KP_Add:
@@ -314,6 +355,7 @@ PhoImage* AddImage(char* filename)
     }
     /* Make img the new last image in the list */
     AppendItem(img);
+    JournalRestore(img);
     return img;
 }
 
@@ -344,6 +386,142 @@ static void parseGeom(char* geom, int* width, int* height)
     }
 }
 
+/* Image lists given with -@ listfile (or -@ - for stdin) are read
+ * a chunk at a time from the main loop, so the first image can be
+ * shown while a long list is still coming in. Names are separated
+ * by newlines, or by NULs (as from find -print0) if a NUL comes
+ * in the same read as the first separator.
+ */
+#define LIST_CHUNK_SIZE 65536
+
+static int sListFd = -1;
+static char sListSep = 0;       /* 0 until we've seen a separator */
+static GString* sListPartial = 0;
+
+static void OpenImageList(char* listfile)
+{
+    if (sListFd >= 0) {
+        fprintf(stderr, "Only one -@ list allowed\n");
+        Usage();
+    }
+    if (!listfile || !*listfile)
+        Usage();
+
+    if (!strcmp(listfile, "-"))
+        sListFd = 0;
+    else if ((sListFd = open(listfile, O_RDONLY)) < 0) {
+        perror(listfile);
+        exit(1);
+    }
+    sListPartial = g_string_new(0);
+}
+
+/* name must be nul-terminated; AddImage copies it into the string pool */
+static void AddListName(char* name, size_t len)
+{
+    /* Skip blank lines */
+    if (len == 0)
+        return;
+    AddImage(name);
+}
+
+static void CloseImageList()
+{
+    if (sListFd < 0)
+        return;
+    AddListName(sListPartial->str, sListPartial->len);
+    g_string_free(sListPartial, TRUE);
+    sListPartial = 0;
+    if (sListFd != 0)
+        close(sListFd);
+    sListFd = -1;
+    if (gDebug)
+        printf("Finished reading image list: %d images\n", CountImages());
+}
+
+/* Read and add the next chunk of the list.
+ * Returns 0 at the end of the list (or on error), else 1.
+ */
+static int ReadImageListChunk()
+{
+    char buf[LIST_CHUNK_SIZE];
+    ssize_t nread;
+    char *start, *end, *sep;
+
+    if (sListFd < 0)
+        return 0;
+
+    nread = read(sListFd, buf, sizeof buf);
+    if (nread < 0 && errno == EINTR)
+        return 1;
+    if (nread <= 0) {
+        if (nread < 0)
+            perror("Reading image list");
+        CloseImageList();
+        return 0;
+    }
+
+    /* Decide on the separator once we've seen one */
+    if (!sListSep) {
+        if (memchr(buf, '\0', nread))
+            sListSep = '\0';
+        else if (memchr(buf, '\n', nread))
+            sListSep = '\n';
+        else {
+            g_string_append_len(sListPartial, buf, nread);
+            return 1;
+        }
+    }
+
+    start = buf;
+    end = buf + nread;
+    while ((sep = memchr(start, sListSep, end - start)) != 0) {
+        *sep = '\0';
+        if (sListPartial->len) {
+            g_string_append_len(sListPartial, start, sep - start);
+            AddListName(sListPartial->str, sListPartial->len);
+            g_string_truncate(sListPartial, 0);
+        }
+        else
+            AddListName(start, sep - start);
+        start = sep + 1;
+    }
+    /* Save any partial name for the next chunk */
+    g_string_append_len(sListPartial, start, end - start);
+    return 1;
+}
+
+static gboolean ImageListReadable(GIOChannel* source, GIOCondition condition,
+                                  gpointer data)
+{
+    return ReadImageListChunk() ? TRUE : FALSE;
+}
+
+/* Read enough of the list to have an image to show, then leave the rest
+ * to the main loop. Random order needs the whole list up front.
+ */
+static void StartImageList()
+{
+    GIOChannel* channel;
+
+    if (sListFd < 0)
+        return;
+
+    while (ReadImageListChunk())
+        if (!gRandomOrder && CountImages() > 0)
+            break;
+
+    if (sListFd < 0)
+        return;
+
+    /* Low priority, so drawing and key events come first */
+    channel = g_io_channel_unix_new(sListFd);
+    g_io_add_watch_full(channel, G_PRIORITY_LOW,
+                        G_IO_IN | G_IO_HUP | G_IO_ERR,
+                        ImageListReadable, 0, 0);
+    g_io_channel_unref(channel);
+}
+
 /* CheckArg takes a string, like -Pvg, and sets all the relevant flags. */
 static void CheckArg(char* arg)
 {
@@ -430,6 +608,25 @@ static void CheckArg(char* arg)
     }
 }
 
+/* The file given with --session, if any. It's looked for before
+ * anything else on the command line is read, so that the session's
+ * images come first wherever --session is.
+ */
+static char* SessionArg(int argc, char** argv)
+{
+    int i;
+
+    for (i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--"))
+            break;
+        if (!strncmp(argv[i], "--session=", 10))
+            return argv[i] + 10;
+        if (!strcmp(argv[i], "--session") && i + 1 < argc)
+            return argv[i + 1];
+    }
+    return 0;
+}
+
 int main(int argc, char** argv)
 {
     /* Initialize some defaults from environment variables,
@@ -438,17 +635,134 @@ int main(int argc, char** argv)
     int options = 1;
 
     char* env = getenv("PHO_ARGS");
+    char* session;
     if (env && *env)
         CheckArg(env);
 
+    if ((session = SessionArg(argc, argv)) != 0)
+        sResumePos = ResumeSession(session);
+
     while (argc > 1)
     {
-        if (argv[1][0] == '-' && options) {
+        if (argv[1][0] == '-' && argv[1][1] == '@' && options) {
+            /* -@ listfile, or -@listfile */
+            if (argv[1][2])
+                OpenImageList(argv[1] + 2);
+            else if (argc > 2) {
+                OpenImageList(argv[2]);
+                --argc;
+                ++argv;
+            }
+            else
+                Usage();
+        }
+        else if (!strncmp(argv[1], "--seed", 6) && options) {
+            /* --seed N, or --seed=N */
+            if (argv[1][6] == '=')
+                SetRandomSeed(argv[1] + 7);
+            else if (argv[1][6] == '\0' && argc > 2) {
+                SetRandomSeed(argv[2]);
+                --argc;
+                ++argv;
+            }
+            else
+                Usage();
+        }
+        else if (!strncmp(argv[1], "--watch", 7) && options) {
+            /* --watch dir, or --watch=dir */
+            if (argv[1][7] == '=')
+                WatchDirectory(argv[1] + 8);
+            else if (argv[1][7] == '\0' && argc > 2) {
+                WatchDirectory(argv[2]);
+                --argc;
+                ++argv;
+            }
+            else
+                Usage();
+        }
+        else if (!strcmp(argv[1], "--follow") && options)
+            gWatchFollow = 1;
+        else if (!strcmp(argv[1], "--xmp") && options)
+            gUseXmp = 1;
+        else if (!strncmp(argv[1], "--journal", 9) && options) {
+            /* --journal file, or --journal=file */
+            if (argv[1][9] == '=')
+                OpenJournal(argv[1] + 10);
+            else if (argv[1][9] == '\0' && argc > 2) {
+                OpenJournal(argv[2]);
+                --argc;
+                ++argv;
+            }
+            else
+                Usage();
+        }
+        else if (!strncmp(argv[1], "--session", 9) && options) {
+            /* --session file, or --session=file */
+            if (gSessionFile) {
+                fprintf(stderr, "Only one --session allowed\n");
+                Usage();
+            }
+            if (argv[1][9] == '=')
+                gSessionFile = argv[1] + 10;
+            else if (argv[1][9] == '\0' && argc > 2) {
+                gSessionFile = argv[2];
+                --argc;
+                ++argv;
+            }
+            else
+                Usage();
+        }
+        else if (!strncmp(argv[1], "--notes-format", 14) && options) {
+            /* --notes-format fmt, or --notes-format=fmt */
+            char* fmt = 0;
+            if (argv[1][14] == '=')
+                fmt = argv[1] + 15;
+            else if (argv[1][14] == '\0' && argc > 2) {
+                fmt = argv[2];
+                --argc;
+                ++argv;
+            }
+            if (!fmt || SetNotesFormat(fmt) < 0)
+                Usage();
+        }
+        else if (!strncmp(argv[1], "--transition", 12) && options) {
+            /* --transition name, or --transition=name */
+            char* name = 0;
+            if (argv[1][12] == '=')
+                name = argv[1] + 13;
+            else if (argv[1][12] == '\0' && argc > 2) {
+                name = argv[2];
+                --argc;
+                ++argv;
+            }
+            if (!name || SetTransition(name) < 0)
+                Usage();
+        }
+        else if (!strncmp(argv[1], "--trash", 7) && options) {
+            /* --trash dir, or --trash=dir */
+            if (argv[1][7] == '=')
+                gTrashDir = argv[1] + 8;
+            else if (argv[1][7] == '\0' && argc > 2) {
+                gTrashDir = argv[2];
+                --argc;
+                ++argv;
+            }
+            else
+                Usage();
+            if (!g_file_test(gTrashDir, G_FILE_TEST_IS_DIR)) {
+                fprintf(stderr, "%s is not a directory\n", gTrashDir);
+                exit(1);
+            }
+        }
+        else if (argv[1][0] == '-' && options) {
             if (strcmp(argv[1], "--"))
                 CheckArg(argv[1]);
             else
                 options = 0;
         }
+        else if (g_file_test(argv[1], G_FILE_TEST_IS_DIR)) {
+            AddDirectory(argv[1]);
+        }
         else {
             AddImage(argv[1]);
         }
@@ -456,11 +770,25 @@ int main(int argc, char** argv)
         ++argv;
     }
 
-    if (gFirstImage == 0)
+    StartImageList();
+
+    /* Directories are still being read. Random order needs them all;
+     * otherwise, one image is enough to get started.
+     */
+    if (gRandomOrder || CountImages() == 0)
+        WaitForDirScans(gRandomOrder);
+
+    /* In --watch mode, an empty directory isn't an error */
+    if (CountImages() == 0)
+        WaitForWatchedImage();
+
+    if (CountImages() == 0)
         Usage();
 
-    if (gRandomOrder)
-        ShuffleImages();
+    /* A resumed session is already in the order it was shown in */
+    if (gRandomOrder && sResumePos < 0)
+        ShuffleImages(sHaveRandomSeed ? sRandomSeed
+                                      : (unsigned int)(time(NULL) ^ getpid()));
 
     /* Initialize some variables associated with the notes flags */
     InitNotes();
@@ -489,8 +817,11 @@ int main(int argc, char** argv)
     gdk_monitor_get_geometry(monitor, &geometry);
     gPhysMonitorWidth = gMonitorWidth = geometry.width;
     gPhysMonitorHeight = gMonitorHeight = geometry.height;
+    gScaleFactor = gdk_monitor_get_scale_factor(monitor);
 
-    /* Load the first image */
+    /* Load the first image, or the one a resumed session was on */
+    if (sResumePos > 0)
+        SetCurrentPosition(sResumePos - 1);
     if (NextImage() != 0)
         exit(1);
 
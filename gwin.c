@@ -43,10 +43,34 @@ int sDragOffsetY = 0;
 int sDragStartX = 0;
 int sDragStartY = 0;
 
+/* Drag motion not yet applied to sDragOffsetX/Y: motion events only
+ * add to these, and the frame clock applies them once per frame.
+ */
+static int sPanDX = 0;
+static int sPanDY = 0;
+static guint sPanTick = 0;
+
 /* gtk related window attributes */
 GtkWidget *gWin = 0;
 static GtkWidget *sDrawingArea = 0;
 
+/* With -n, each image gets a fresh window. Rather than destroying the
+ * old window and building a new one every time, pho keeps two, built
+ * and realized once: the next image goes into the hidden one, which
+ * is shown before the old one is hidden, so there's no gap between
+ * them. Without -n, only the first is used.
+ */
+typedef struct {
+    GtkWidget* win;
+    GtkWidget* area;
+} PhoWindow;
+
+static PhoWindow sWindows[2];
+static int sCurWindow = -1;
+
+/* The window just swapped out, to hide once its replacement is drawn */
+static GtkWidget* sRetiringWin = 0;
+
 /* This is so gross. GTK has no way to tell if a window has been exposed.
  * GTK_WIDGET_MAPPED and GTK_WIDGET_VISIBLE are both true before the
  * main loop has run or an expose event has happened.
@@ -100,7 +124,9 @@ static void hide_cursor(GtkWidget* w)
 
 static void show_cursor(GtkWidget* w)
 {
-    gdk_window_set_cursor(gtk_widget_get_window(w), NULL);
+    GdkWindow *window = gtk_widget_get_window(w);
+    if (window != NULL)
+        gdk_window_set_cursor(window, NULL);
 }
 
 /*
@@ -139,8 +165,13 @@ static void AdjustScreenSize()
         gMonitorHeight = gPhysMonitorHeight - sFrameHeight;
     }
 
-    if (gCurImage)
+    /* Callers go on to place the window, so the image has to fit
+     * the new size now, not on the next frame.
+     */
+    if (gCurImage) {
         ScaleAndRotate(gCurImage, 0);
+        CommitRender();
+    }
 }
 
 static void CenterWindow(GtkWidget* win)
@@ -226,6 +257,7 @@ double FracOfScreenSize() {
 int SetViewModes(int dispmode, int scalemode, double scalefactor)
 {
     sDragOffsetX = sDragOffsetY = 0;
+    sPanDX = sPanDY = 0;
 
     if (dispmode == gDisplayMode && scalemode == gScaleMode
         && scalefactor == gScaleRatio)
@@ -297,7 +329,9 @@ int SetViewModes(int dispmode, int scalemode, double scalefactor)
          * XXX unfortunately this doesn't work when changing from keywords
          * to fullscreen/normal.
          */
-        int ret = ScaleAndRotate(gCurImage, 0);
+        int ret;
+        ScaleAndRotate(gCurImage, 0);
+        ret = CommitRender();
         if (ret != 0) return ret;
         MaybeMove();
     }
@@ -309,6 +343,299 @@ int SetViewModes(int dispmode, int scalemode, double scalefactor)
     return 0;
 }
 
+/* Where the top left of the image goes in presentation mode */
+static void PresentationOrigin(int* x, int* y)
+{
+    gint width, height;
+
+    /* Center the image. This has to be done according to
+     * the current window size, not the phys monitor size,
+     * because in the xinerama case, gtk_window_fullscreen()
+     * only fullscreens the current monitor, not all of them.
+     */
+    gtk_window_get_size(GTK_WINDOW(gWin), &width, &height);
+
+    /* If we have a presentation screen size set (e.g. for a projector
+     * that has a different resolution from our native monitor),
+     * Fudge the screen size and center based on a virtual screen
+     * starting in the upper left corner of our current screen.
+     * That way, it will center on the projector or other device.
+     */
+    if (gPresentationWidth > 0)
+        width = gPresentationWidth;
+    if (gPresentationHeight > 0)
+        height = gPresentationHeight;
+
+    *x = (width - gCurImage->curWidth) / 2 + sDragOffsetX;
+    *y = (height - gCurImage->curHeight) / 2 + sDragOffsetY;
+
+    /* But we probably shouldn't allow dragging the image
+     * completely off the screen -- just drag to the point where
+     * a corner is visible.
+     */
+    /* Left edge */
+    if (gCurImage->curWidth > gMonitorWidth
+        && *x < gMonitorWidth - gCurImage->curWidth)
+        *x = gMonitorWidth - gCurImage->curWidth;
+    else if (gCurImage->curWidth <= gMonitorWidth && *x <= 0)
+        *x = 0;
+
+    /* Top edge */
+    if (gCurImage->curHeight > gMonitorHeight
+        && *y < gMonitorHeight - gCurImage->curHeight)
+        *y = gMonitorHeight - gCurImage->curHeight;
+    else if (gCurImage->curHeight <= gMonitorHeight && *y <= 0)
+        *y = 0;
+
+    /* Right edge */
+    if (gCurImage->curWidth < gMonitorWidth
+        && *x > gMonitorWidth - gCurImage->curWidth)
+        *x = gMonitorWidth - gCurImage->curWidth;
+    else if (gCurImage->curWidth >= gMonitorWidth
+             && *x > 0)
+        *x = 0;
+
+    /* Bottom edge */
+    if (gCurImage->curHeight < gMonitorHeight
+        && *y > gMonitorHeight - gCurImage->curHeight)
+        *y = gMonitorHeight - gCurImage->curHeight;
+    else if (gCurImage->curHeight >= gMonitorHeight
+             && *y > 0)
+        *y = 0;
+
+    /* XXX Would be good to reset sDragOffsetX and sDragOffsetY
+     * in these cases so they don't get crazily out of kilter.
+     */
+}
+
+/* The current image as a cairo surface, made once per image rather
+ * than on every draw, and the pixbuf it was made from (held, so it
+ * can't be freed and another one allocated in its place).
+ */
+static cairo_surface_t* sImageSurface = 0;
+static GdkPixbuf* sSurfacePixbuf = 0;
+static int sSurfaceScale = 0;
+
+static cairo_surface_t* ImageSurface()
+{
+    if (sSurfacePixbuf != gImage || sSurfaceScale != gScaleFactor) {
+        if (sImageSurface)
+            cairo_surface_destroy(sImageSurface);
+        if (sSurfacePixbuf)
+            g_object_unref(sSurfacePixbuf);
+        sSurfacePixbuf = g_object_ref(gImage);
+        sSurfaceScale = gScaleFactor;
+        /* gImage is at device resolution: with the surface's device
+         * scale set to match, it's drawn pixel for pixel, in logical
+         * coordinates like everything else.
+         */
+        sImageSurface = gdk_cairo_surface_create_from_pixbuf(gImage,
+                                                             gScaleFactor,
+                                                             0);
+    }
+    return sImageSurface;
+}
+
+/* Paint the image with its top left at x, y, touching only what's
+ * inside the area being drawn, so a small expose or a drag costs in
+ * proportion to what changed rather than to the size of the screen.
+ * With letterbox set, whatever the image doesn't cover is filled black.
+ */
+static void PaintImage(cairo_t* cr, int x, int y, int letterbox)
+{
+    int w = gCurImage->curWidth;
+    int h = gCurImage->curHeight;
+    double x1, y1, x2, y2;
+
+    cairo_clip_extents(cr, &x1, &y1, &x2, &y2);
+
+    if (letterbox && (x1 < x || y1 < y || x2 > x + w || y2 > y + h)) {
+        /* Everything drawn, less the image */
+        cairo_set_fill_rule(cr, CAIRO_FILL_RULE_EVEN_ODD);
+        cairo_rectangle(cr, x1, y1, x2 - x1, y2 - y1);
+        cairo_rectangle(cr, x, y, w, h);
+        cairo_set_source_rgb(cr, 0, 0, 0);
+        cairo_fill(cr);
+        cairo_set_fill_rule(cr, CAIRO_FILL_RULE_WINDING);
+    }
+
+    if (x2 <= x || y2 <= y || x1 >= x + w || y1 >= y + h)
+        return;
+    cairo_set_source_surface(cr, ImageSurface(), x, y);
+    cairo_rectangle(cr, x, y, w, h);
+    cairo_fill(cr);
+}
+
+/* Slideshow transitions (--transition) run for TRANSITION_MILLIS,
+ * painted once per frame from the frame clock, from the surface the
+ * last image was drawn from and the one for the new image; nothing is
+ * decoded or scaled while one runs. If the frame clock misses a refresh
+ * more than once, the rest is skipped, so a slow display gets a clean
+ * cut rather than a stutter. That's judged from the gap between ticks,
+ * not by timing the painting: cairo only queues the work there, and the
+ * compositing that can't keep up happens after it returns.
+ */
+#define TRANSITION_MILLIS 600
+#define TRANSITION_SLOW_FRAMES 2
+#define TRANSITION_FRAME_USEC 16667     /* if the refresh rate is unknown */
+
+int gTransition = PHO_TRANSITION_NONE;
+
+static const char* sTransitionNames[] = { "none", "fade", "slide" };
+
+/* The image being left, where it was */
+static cairo_surface_t* sFromSurface = 0;
+static PhoImage* sFromImage = 0;
+static int sFromX, sFromY, sFromWidth, sFromHeight;
+
+static guint sTransitionTick = 0;
+static gint64 sTransitionStart = 0;
+static double sTransitionProgress = 0;
+static gint64 sLastFrameTime = 0;
+static int sSlowFrames = 0;
+
+int SetTransition(const char* name)
+{
+    int i;
+
+    for (i = 0; i < (int)G_N_ELEMENTS(sTransitionNames); ++i)
+        if (!strcmp(name, sTransitionNames[i])) {
+            gTransition = i;
+            return 0;
+        }
+    return -1;
+}
+
+static void DropTransition()
+{
+    if (sFromSurface)
+        cairo_surface_destroy(sFromSurface);
+    sFromSurface = 0;
+    sFromImage = 0;
+}
+
+/* Stop a transition that's running, and just show the image */
+static void EndTransition()
+{
+    if (!sTransitionTick)
+        return;
+    gtk_widget_remove_tick_callback(sDrawingArea, sTransitionTick);
+    sTransitionTick = 0;
+    DropTransition();
+    gtk_widget_queue_draw(sDrawingArea);
+}
+
+/* Did the frame clock skip a refresh since the last transition frame? */
+static int MissedFrame(GdkFrameClock* clock, gint64 now)
+{
+    gint64 interval = 0;
+
+    if (!sLastFrameTime)
+        return 0;
+    gdk_frame_clock_get_refresh_info(clock, now, &interval, 0);
+    if (interval <= 0)
+        interval = TRANSITION_FRAME_USEC;
+    return now - sLastFrameTime > interval * 3 / 2;
+}
+
+static gboolean TransitionTick(GtkWidget* widget, GdkFrameClock* clock,
+                               gpointer data)
+{
+    gint64 now = gdk_frame_clock_get_frame_time(clock);
+
+    if (sTransitionProgress >= 1.) {
+        sTransitionTick = 0;
+        DropTransition();
+        gtk_widget_queue_draw(widget);
+        return G_SOURCE_REMOVE;
+    }
+
+    if (sTransitionStart == 0)
+        sTransitionStart = now;
+    sTransitionProgress = (now - sTransitionStart)
+        / (TRANSITION_MILLIS * 1000.);
+    if (sTransitionProgress > 1.)
+        sTransitionProgress = 1.;
+    if (MissedFrame(clock, now) && ++sSlowFrames >= TRANSITION_SLOW_FRAMES) {
+        if (gDebug)
+            printf("Transition frames too slow; skipping the rest\n");
+        sTransitionProgress = 1.;
+    }
+    sLastFrameTime = now;
+    gtk_widget_queue_draw(widget);
+    return G_SOURCE_CONTINUE;
+}
+
+/* The slideshow is about to move on: remember the image on the screen,
+ * to transition from once the next one is ready.
+ */
+void TakeTransitionSnapshot()
+{
+    EndTransition();
+    DropTransition();
+    if (gTransition == PHO_TRANSITION_NONE
+        || gDisplayMode != PHO_DISPLAY_PRESENTATION
+        || !gCurImage || !gImage || !sDrawingArea || !sExposed)
+        return;
+
+    sFromSurface = cairo_surface_reference(ImageSurface());
+    sFromImage = gCurImage;
+    PresentationOrigin(&sFromX, &sFromY);
+    sFromWidth = gCurImage->curWidth;
+    sFromHeight = gCurImage->curHeight;
+}
+
+/* The next image is loaded: run the transition to it */
+void StartTransition()
+{
+    if (!sFromSurface || sTransitionTick)
+        return;
+    if (gCurImage == sFromImage || !gImage
+        || gDisplayMode != PHO_DISPLAY_PRESENTATION) {
+        DropTransition();
+        return;
+    }
+
+    sTransitionStart = 0;
+    sTransitionProgress = 0;
+    sLastFrameTime = 0;
+    sSlowFrames = 0;
+    sTransitionTick = gtk_widget_add_tick_callback(sDrawingArea,
+                                                   TransitionTick, 0, 0);
+}
+
+/* One frame of the transition, with the new image's top left at x, y */
+static void PaintTransition(cairo_t* cr, int x, int y)
+{
+    double p = sTransitionProgress;
+
+    cairo_set_source_rgb(cr, 0, 0, 0);
+    cairo_paint(cr);
+
+    if (gTransition == PHO_TRANSITION_SLIDE) {
+        /* The old image goes off to the left as the new one comes in */
+        int shift = (int)(gtk_widget_get_allocated_width(sDrawingArea) * p);
+        int newX = x + gtk_widget_get_allocated_width(sDrawingArea) - shift;
+
+        cairo_set_source_surface(cr, sFromSurface, sFromX - shift, sFromY);
+        cairo_rectangle(cr, sFromX - shift, sFromY, sFromWidth, sFromHeight);
+        cairo_fill(cr);
+        cairo_set_source_surface(cr, ImageSurface(), newX, y);
+        cairo_rectangle(cr, newX, y,
+                        gCurImage->curWidth, gCurImage->curHeight);
+        cairo_fill(cr);
+    }
+    else {
+        /* A crossfade: old and new added together over the black */
+        cairo_set_operator(cr, CAIRO_OPERATOR_ADD);
+        cairo_set_source_surface(cr, sFromSurface, sFromX, sFromY);
+        cairo_paint_with_alpha(cr, 1. - p);
+        cairo_set_source_surface(cr, ImageSurface(), x, y);
+        cairo_paint_with_alpha(cr, p);
+        cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+    }
+}
+
 /* DrawImage is called from the expose callback.
  * It assumes we already have the image in gImage.
  */
@@ -330,75 +657,28 @@ void DrawImage(cairo_t *cr)
                gCurImage->curWidth, gCurImage->curHeight);
     }
 
-    if (gDisplayMode == PHO_DISPLAY_PRESENTATION) {
-        gint width, height;
-        /* GTK3: Clear background using the provided cairo context */
-        cairo_set_source_rgb(cr, 0, 0, 0);
-        cairo_paint(cr);
-
-        /* Center the image. This has to be done according to
-         * the current window size, not the phys monitor size,
-         * because in the xinerama case, gtk_window_fullscreen()
-         * only fullscreens the current monitor, not all of them.
-         */
-        gtk_window_get_size(GTK_WINDOW(gWin), &width, &height);
-
-        /* If we have a presentation screen size set (e.g. for a projector
-         * that has a different resolution from our native monitor),
-         * Fudge the screen size and center based on a virtual screen
-         * starting in the upper left corner of our current screen.
-         * That way, it will center on the projector or other device.
-         */
-        if (gPresentationWidth > 0)
-            width = gPresentationWidth;
-        if (gPresentationHeight > 0)
-            height = gPresentationHeight;
-
-        dstX = (width - gCurImage->curWidth) / 2 + sDragOffsetX;
-        dstY = (height - gCurImage->curHeight) / 2 + sDragOffsetY;
-
-        /* But we probably shouldn't allow dragging the image
-         * completely off the screen -- just drag to the point where
-         * a corner is visible.
-         */
-        /* Left edge */
-        if (gCurImage->curWidth > gMonitorWidth
-            && dstX < gMonitorWidth - gCurImage->curWidth)
-            dstX = gMonitorWidth - gCurImage->curWidth;
-        else if (gCurImage->curWidth <= gMonitorWidth && dstX <= 0)
-            dstX = 0;
-
-        /* Top edge */
-        if (gCurImage->curHeight > gMonitorHeight
-            && dstY < gMonitorHeight - gCurImage->curHeight)
-            dstY = gMonitorHeight - gCurImage->curHeight;
-        else if (gCurImage->curHeight <= gMonitorHeight && dstY <= 0)
-            dstY = 0;
-
-        /* Right edge */
-        if (gCurImage->curWidth < gMonitorWidth
-            && dstX > gMonitorWidth - gCurImage->curWidth)
-            dstX = gMonitorWidth - gCurImage->curWidth;
-        else if (gCurImage->curWidth >= gMonitorWidth
-                 && dstX > 0)
-            dstX = 0;
-
-        /* Bottom edge */
-        if (gCurImage->curHeight < gMonitorHeight
-            && dstY > gMonitorHeight - gCurImage->curHeight)
-            dstY = gMonitorHeight - gCurImage->curHeight;
-        else if (gCurImage->curHeight >= gMonitorHeight
-                 && dstY > 0)
-            dstY = 0;
-
-        /* XXX Would be good to reset sDragOffsetX and sDragOffsetY
-         * in these cases so they don't get crazily out of kilter.
-         */
-    }
+    if (gDisplayMode == PHO_DISPLAY_PRESENTATION)
+        PresentationOrigin(&dstX, &dstY);
     else {
         /* Update the titlebar */
-        snprintf(title, sizeof(title), "pho: %s (%d x %d)", gCurImage->filename,
-                gCurImage->trueWidth, gCurImage->trueHeight);
+        if (ImageFilter()) {
+            /* Count only the images that pass the filter */
+            int rank = FilterRank(CurrentPosition());
+            char pos[16];
+            if (rank >= 0)
+                snprintf(pos, sizeof pos, "%d", rank + 1);
+            else
+                strcpy(pos, "-");
+            snprintf(title, sizeof(title), "pho: %s (%d x %d) [%s/%d %s]",
+                     gCurImage->filename,
+                     gCurImage->trueWidth, gCurImage->trueHeight,
+                     pos, FilterCount(), ImageFilter());
+        }
+        else
+            snprintf(title, sizeof(title), "pho: %s (%d x %d) [%d/%d]",
+                     gCurImage->filename,
+                     gCurImage->trueWidth, gCurImage->trueHeight,
+                     LiveRank(CurrentPosition()) + 1, CountImages());
         if (HasExif())
         {
             const char* date = ExifGetString(ExifDate);
@@ -443,9 +723,12 @@ void DrawImage(cairo_t *cr)
         }
     }
 
-    /* GTK3: Draw the image using the provided cairo context */
-    gdk_cairo_set_source_pixbuf(cr, gImage, dstX, dstY);
-    cairo_paint(cr);
+    if (sTransitionTick && gDisplayMode == PHO_DISPLAY_PRESENTATION)
+        PaintTransition(cr, dstX, dstY);
+    else {
+        ++gRenderStats.paints;
+        PaintImage(cr, dstX, dstY, gDisplayMode == PHO_DISPLAY_PRESENTATION);
+    }
 
     UpdateInfoDialog(gCurImage);
 }
@@ -453,7 +736,8 @@ void DrawImage(cairo_t *cr)
 static gboolean
 HandlePress(GtkWidget *widget, GdkEventButton *event)
 {
-    if (event->button != 2 )
+    /* Dragging is only for presentation mode */
+    if (event->button != 2 || gDisplayMode != PHO_DISPLAY_PRESENTATION)
         return TRUE;
 
     /*  grab with owner_events == TRUE so the popup's widgets can
@@ -487,6 +771,72 @@ HandleRelease(GtkWidget *widget, GdkEventButton *event)
     return TRUE;
 }
 
+/* The image has been dragged from oldX, oldY in presentation mode:
+ * redraw only where it was and where it is now.
+ */
+static void QueueImageMove(int oldX, int oldY)
+{
+    cairo_rectangle_int_t rect;
+    cairo_region_t* damage;
+    int x, y;
+
+    PresentationOrigin(&x, &y);
+    if (x == oldX && y == oldY)
+        return;
+
+    rect.x = oldX;
+    rect.y = oldY;
+    rect.width = gCurImage->curWidth;
+    rect.height = gCurImage->curHeight;
+    damage = cairo_region_create_rectangle(&rect);
+    rect.x = x;
+    rect.y = y;
+    cairo_region_union_rectangle(damage, &rect);
+    gtk_widget_queue_draw_region(sDrawingArea, damage);
+    cairo_region_destroy(damage);
+}
+
+/* Forget any drag motion not yet applied */
+static void StopPanning()
+{
+    if (sPanTick)
+        gtk_widget_remove_tick_callback(sDrawingArea, sPanTick);
+    sPanTick = 0;
+    sPanDX = sPanDY = 0;
+}
+
+/* Called by the frame clock before each frame while a drag is going:
+ * move the image by however far the pointer went since the last frame.
+ */
+static gboolean PanTick(GtkWidget* widget, GdkFrameClock* clock,
+                        gpointer data)
+{
+    int presenting = (gDisplayMode == PHO_DISPLAY_PRESENTATION
+                      && gCurImage && gImage);
+    int oldX = 0, oldY = 0;
+
+    if (sPanDX == 0 && sPanDY == 0) {
+        sPanTick = 0;
+        return G_SOURCE_REMOVE;
+    }
+
+    if (presenting)
+        PresentationOrigin(&oldX, &oldY);
+
+    /* Drag offsets will get sanity checked when we show the image,
+     * to disallow dragging the image entirely off the screen.
+     */
+    sDragOffsetX += sPanDX;
+    sDragOffsetY += sPanDY;
+    sPanDX = sPanDY = 0;
+
+    if (presenting)
+        QueueImageMove(oldX, oldY);
+    else
+        gtk_widget_queue_draw(widget);
+    return G_SOURCE_CONTINUE;
+}
+
 static gboolean
 HandleMotionNotify(GtkWidget *widget, GdkEventMotion *event)
 {
@@ -498,11 +848,8 @@ HandleMotionNotify(GtkWidget *widget, GdkEventMotion *event)
     gdk_window_get_device_position(gtk_widget_get_window(widget), device, &x, &y, &state);
 
     if (state & GDK_BUTTON2_MASK) {
-        sDragOffsetX += x - sDragStartX;
-        sDragOffsetY += y - sDragStartY;
-        /* Drag offsets will get sanity checked when we show the image,
-         * to disallow dragging the image entirely off the screen.
-         */
+        sPanDX += x - sDragStartX;
+        sPanDY += y - sDragStartY;
 
         /* We've handled this drag, so the next motion event
          * should start from here.
@@ -546,8 +893,9 @@ HandleMotionNotify(GtkWidget *widget, GdkEventMotion *event)
             }
         }
 
-        /* This flickers: would be nice to collapse events more */
-        gtk_widget_queue_draw(sDrawingArea);
+        if (!sPanTick && (sPanDX != 0 || sPanDY != 0))
+            sPanTick = gtk_widget_add_tick_callback(sDrawingArea, PanTick,
+                                                    0, 0);
     }
 
     return TRUE;
@@ -556,10 +904,23 @@ HandleMotionNotify(GtkWidget *widget, GdkEventMotion *event)
 /* GTK3: "draw" signal handler replaces "expose_event"
  * The draw signal provides a cairo_t for rendering.
  */
+/* The new window has been drawn, so the old one can go */
+static gboolean HideRetiringWindow(gpointer data)
+{
+    if (sRetiringWin && sRetiringWin != gWin)
+        gtk_widget_hide(sRetiringWin);
+    sRetiringWin = 0;
+    return FALSE;
+}
+
 static gboolean HandleExpose(GtkWidget* widget, cairo_t *cr)
 {
     gint width, height;
 
+    /* A window on its way out: just let it be black */
+    if (widget != sDrawingArea)
+        return FALSE;
+
     sExposed = 1;
     width = gtk_widget_get_allocated_width(widget);
     height = gtk_widget_get_allocated_height(widget);
@@ -611,15 +972,26 @@ static gboolean HandleExpose(GtkWidget* widget, cairo_t *cr)
 
     DrawImage(cr);
 
+    if (sRetiringWin)
+        g_idle_add(HideRetiringWindow, 0);
+
     return TRUE;
 }
 
 void EndSession()
 {
-    gCurImage = 0;
+    int pos = CurrentPosition();
+
+    SetCurrentImage(-1);
     UpdateInfoDialog();
     RememberKeywords();
     PrintNotes();
+    FinishCaptionWrites();
+    FinishXmpWrites();
+    FinishDeletes();
+    if (gSessionFile)
+        SaveSession(gSessionFile, pos);
+    CloseJournal();
     /* Ensure all pending GTK events are processed before quitting */
     while (gtk_events_pending())
         gtk_main_iteration();
@@ -674,30 +1046,38 @@ void MoveWin2Monitor(int whichmon, int x, int y)
     gtk_window_move(GTK_WINDOW(gWin), rect.x + x, rect.y + y);
 }
 
-/* Make a new window, destroying the old one. */
-static void NewWindow()
+/* The window has moved to a monitor with a different scale factor:
+ * render the image again at the new device resolution.
+ */
+static void HandleScaleFactor(GtkWidget* widget, GParamSpec* pspec,
+                              gpointer data)
 {
-    gint root_x = 0;
-    gint root_y = 0;
-
-    sExposed = 0;    /* reset the exposed flag */
+    int scale = gtk_widget_get_scale_factor(widget);
 
+    if (widget != gWin || scale == gScaleFactor || scale < 1)
+        return;
     if (gDebug)
-        printf("NewWindow()\n");
+        printf("Scale factor now %d\n", scale);
+    gScaleFactor = scale;
+    AdjustScreenSize();
+    /* The logical size may be the same, but the pixels aren't */
+    if (sDrawingArea)
+        gtk_widget_queue_draw(sDrawingArea);
+}
 
-    if (gWin) {
-        gdk_window_get_position(gtk_widget_get_window(gWin), &root_x, &root_y);
-        gtk_widget_destroy(gWin);
-    }
+/* Build a window and its drawing area, ready to be shown */
+static void BuildWindow(PhoWindow* pw)
+{
+    static GtkCssProvider *css_provider = 0;
 
-    gWin = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+    pw->win = gtk_window_new(GTK_WINDOW_TOPLEVEL);
 
     /* GTK3: gtk_window_set_wmclass is deprecated with no replacement.
      * The WM_CLASS is set automatically from the application name.
      */
 
     /* Window manager delete */
-    g_signal_connect(G_OBJECT(gWin), "delete-event",
+    g_signal_connect(G_OBJECT(pw->win), "delete-event",
                        G_CALLBACK(HandleDelete), 0);
 
     /* This event occurs when we call gtk_widget_destroy() on the window,
@@ -709,22 +1089,76 @@ static void NewWindow()
     /* KeyPress events on the drawing area don't come through --
      * they have to be on the window.
      */
-    g_signal_connect(G_OBJECT(gWin), "key-press-event",
+    g_signal_connect(G_OBJECT(pw->win), "key-press-event",
                        G_CALLBACK(HandleGlobalKeys), 0);
 
-    sDrawingArea = gtk_drawing_area_new();
-    gtk_container_add(GTK_CONTAINER(gWin), sDrawingArea);
-    gtk_widget_show(sDrawingArea);
+    g_signal_connect(G_OBJECT(pw->win), "notify::scale-factor",
+                       G_CALLBACK(HandleScaleFactor), 0);
+
+    pw->area = gtk_drawing_area_new();
+    gtk_container_add(GTK_CONTAINER(pw->win), pw->area);
+    gtk_widget_show(pw->area);
 
     /* GTK3: Use CSS instead of gtk_widget_modify_bg */
-    GtkCssProvider *css_provider = gtk_css_provider_new();
-    gtk_css_provider_load_from_data(css_provider,
-        "drawingarea { background-color: #000000; }", -1, NULL);
+    if (!css_provider) {
+        css_provider = gtk_css_provider_new();
+        gtk_css_provider_load_from_data(css_provider,
+            "drawingarea { background-color: #000000; }", -1, NULL);
+    }
     gtk_style_context_add_provider(
-        gtk_widget_get_style_context(sDrawingArea),
+        gtk_widget_get_style_context(pw->area),
         GTK_STYLE_PROVIDER(css_provider),
         GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
 
+    /* Listen for middle clicks to drag position in presentation mode */
+    gtk_widget_set_events(pw->area, GDK_BUTTON_PRESS_MASK);
+    g_signal_connect(G_OBJECT(pw->area), "button-press-event",
+                       G_CALLBACK(HandlePress), 0);
+    g_signal_connect(G_OBJECT(pw->area), "button-release-event",
+                       G_CALLBACK(HandleRelease), 0);
+    g_signal_connect(G_OBJECT(pw->area), "motion-notify-event",
+                       G_CALLBACK(HandleMotionNotify), 0);
+
+    g_signal_connect(G_OBJECT(pw->area), "draw",
+                       G_CALLBACK(HandleExpose), 0);
+    /* To track in/out of fullscreen mode, use configure_event
+     * or window_state_event.
+     */
+
+    gtk_widget_realize(pw->win);
+}
+
+/* Show the image in a new window: the other one of the two with -n
+ * (building it the first time), replacing the one that was showing.
+ */
+static void NewWindow()
+{
+    gint root_x = 0;
+    gint root_y = 0;
+    GtkWidget* oldWin = gWin;
+    PhoWindow* pw;
+
+    sExposed = 0;    /* reset the exposed flag */
+
+    if (gDebug)
+        printf("NewWindow()\n");
+
+    if (oldWin) {
+        gdk_window_get_position(gtk_widget_get_window(oldWin),
+                                &root_x, &root_y);
+        /* What was going on in the old window stops */
+        StopPanning();
+        EndTransition();
+        DropTransition();
+    }
+
+    sCurWindow = (sCurWindow + 1) % G_N_ELEMENTS(sWindows);
+    pw = &sWindows[sCurWindow];
+    if (!pw->win)
+        BuildWindow(pw);
+    gWin = pw->win;
+    sDrawingArea = pw->area;
+
     /* We hope this has already been done: LoadImageAndRotate
      * should have called ScaleAndRotate when the image was loaded.
     AdjustScreenSize();
@@ -733,30 +1167,18 @@ static void NewWindow()
         gtk_widget_set_size_request(sDrawingArea,
                               gPhysMonitorWidth, gPhysMonitorHeight);
         gtk_window_fullscreen(GTK_WINDOW(gWin));
-
-        /* Listen for middle clicks to drag position: */
-        gtk_widget_set_events(sDrawingArea, GDK_BUTTON_PRESS_MASK);
-        g_signal_connect(G_OBJECT(sDrawingArea), "button-press-event",
-                           G_CALLBACK(HandlePress), 0);
-        g_signal_connect(G_OBJECT(sDrawingArea), "button-release-event",
-                           G_CALLBACK(HandleRelease), 0);
-        g_signal_connect(G_OBJECT(sDrawingArea), "motion-notify-event",
-                           G_CALLBACK(HandleMotionNotify), 0);
     }
     else {
         if (gCurImage) {
             gtk_widget_set_size_request(sDrawingArea,
                                   gCurImage->curWidth, gCurImage->curHeight);
+            /* It may still be the size of the image it showed last */
+            gtk_window_resize(GTK_WINDOW(gWin),
+                              gCurImage->curWidth, gCurImage->curHeight);
         }
         gtk_window_unfullscreen(GTK_WINDOW(gWin));
     }
 
-    g_signal_connect(G_OBJECT(sDrawingArea), "draw",
-                       G_CALLBACK(HandleExpose), 0);
-    /* To track in/out of fullscreen mode, use configure_event
-     * or window_state_event.
-     */
-
     gtk_widget_show(gWin);
 
     /* Schedule window to be raised after main loop processes events.
@@ -768,6 +1190,8 @@ static void NewWindow()
     /* Must come after show(), hide_cursor needs a window */
     if (gDisplayMode == PHO_DISPLAY_PRESENTATION)
         hide_cursor(sDrawingArea);
+    else
+        show_cursor(sDrawingArea);
 
     /* Hopefully gWin->window exists by now, so it's safe
      * to place it on the intended monitor.
@@ -776,6 +1200,14 @@ static void NewWindow()
         MoveWin2Monitor(gUseMonitor, root_x, root_y);
         // printf("NewWindow: moving to monitor %d\n", gUseMonitor);
     }
+
+    /* The old window stays up until this one has been drawn */
+    if (oldWin && oldWin != gWin)
+        sRetiringWin = oldWin;
+
+    /* Have the other one ready for next time */
+    if (gMakeNewWindows && !sWindows[1 - sCurWindow].win)
+        BuildWindow(&sWindows[1 - sCurWindow]);
 }
 
 /**
@@ -805,6 +1237,12 @@ void PrepareWindow()
     }
 
     sDragOffsetX = sDragOffsetY = 0;
+    sPanDX = sPanDY = 0;
+
+    /* Showing something else cuts a running transition short;
+     * a slideshow starts its next one after this.
+     */
+    EndTransition();
 
     /* If the window is new but hasn't been mapped yet,
      * there's nothing we can do from here.
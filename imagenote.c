@@ -14,27 +14,169 @@
 #include <ctype.h>
 #include <fcntl.h>
 #include <unistd.h>    /* for write() */
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-static char *sFlagFileList[NUM_NOTES];
+/* For each note, the indices (into gImageList) of the images that
+ * have it, in increasing order. This makes counting a note's images,
+ * or listing them, independent of the size of the image list.
+ */
+typedef struct {
+    int* indices;
+    int len, size;
+} NotePosting;
+
+static NotePosting sPostings[NUM_NOTES];
 
 void InitNotes()
+{
+    ClearNoteIndex();
+}
+
+/* Forget which images have which notes, e.g. when the list is cleared */
+void ClearNoteIndex()
 {
     int i;
     for (i=0; i<NUM_NOTES; ++i)
-        sFlagFileList[i] = 0;
+        sPostings[i].len = 0;
 }
 
-void ToggleNoteFlag(PhoImage* img, int note)
+int HasNote(PhoImage* img, int note)
+{
+    if (note < 0 || note >= NUM_NOTES)
+        return 0;
+    return (img->notes.words[note / NOTE_WORD_BITS]
+            & ((guint64)1 << (note % NOTE_WORD_BITS))) != 0;
+}
+
+/* Where index is, or would go, in a posting list */
+static int PostingSlot(NotePosting* p, int index)
+{
+    int lo = 0, hi = p->len;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (p->indices[mid] < index)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void PostingAdd(NotePosting* p, int index)
+{
+    int slot = PostingSlot(p, index);
+
+    if (slot < p->len && p->indices[slot] == index)
+        return;
+    if (p->len >= p->size) {
+        int newsize = p->size ? p->size * 2 : 16;
+        int* newindices = realloc(p->indices, newsize * sizeof (int));
+        if (!newindices) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(1);
+        }
+        p->indices = newindices;
+        p->size = newsize;
+    }
+    memmove(p->indices + slot + 1, p->indices + slot,
+            (p->len - slot) * sizeof (int));
+    p->indices[slot] = index;
+    ++p->len;
+}
+
+static void PostingRemove(NotePosting* p, int index)
+{
+    int slot = PostingSlot(p, index);
+
+    if (slot >= p->len || p->indices[slot] != index)
+        return;
+    memmove(p->indices + slot, p->indices + slot + 1,
+            (p->len - slot - 1) * sizeof (int));
+    --p->len;
+}
+
+/* Tag img with a note, or untag it */
+void SetNote(PhoImage* img, int note, int on)
 {
-    int bit = (1 << note);
-    if (img->noteFlags & bit)
-        img->noteFlags &= ~bit;
+    guint64 bit;
+    guint64* word;
+    int index;
+
+    if (!img || note < 0 || note >= NUM_NOTES || !on == !HasNote(img, note))
+        return;
+
+    word = &img->notes.words[note / NOTE_WORD_BITS];
+    bit = (guint64)1 << (note % NOTE_WORD_BITS);
+    if (on)
+        *word |= bit;
+    else
+        *word &= ~bit;
+    JournalNote(img, note, on);
+    MarkXmpDirty(img);
+
+    index = IndexOfImage(img);
+    if (index < 0)
+        return;
+    if (on)
+        PostingAdd(sPostings + note, index);
     else
-        img->noteFlags |= bit;
+        PostingRemove(sPostings + note, index);
+}
+
+/* Index the notes an image already has, when it's put at index
+ * with its notes set some other way (e.g. from a saved session).
+ */
+void IndexNotes(PhoImage* img, int index)
+{
+    int w, b;
+
+    for (w = 0; w < NOTE_WORDS; ++w) {
+        if (!img->notes.words[w])
+            continue;
+        for (b = 0; b < NOTE_WORD_BITS; ++b)
+            if (img->notes.words[w] & ((guint64)1 << b))
+                PostingAdd(sPostings + w * NOTE_WORD_BITS + b, index);
+    }
+}
+
+/* The images tagged with a note, as indices into gImageList in
+ * increasing order. Some may be 0 if they've since been removed.
+ */
+const int* NoteImages(int note, int* count)
+{
+    if (note < 0 || note >= NUM_NOTES) {
+        *count = 0;
+        return 0;
+    }
+    *count = sPostings[note].len;
+    return sPostings[note].indices;
+}
+
+/* How many images in the list are tagged with a note */
+int NoteCount(int note)
+{
+    const int* indices;
+    int count, i, n = 0;
+
+    indices = NoteImages(note, &count);
+    for (i = 0; i < count; ++i)
+        if (ImageAt(indices[i]))
+            ++n;
+    return n;
+}
+
+void ToggleNoteFlag(PhoImage* img, int note)
+{
+    int on = !HasNote(img, note);
+
+    SetNote(img, note, on);
+    FilterImageChanged(img);
 
     /* Update any dialogs which might be showing toggles */
-    SetInfoDialogToggle(note, (img->noteFlags & bit) != 0);
-    SetKeywordsDialogToggle(note, (img->noteFlags & bit) != 0);
+    SetInfoDialogToggle(note, on);
+    SetKeywordsDialogToggle(note, on);
 }
 
 /* Guard against filenames which contain odd characters, like
@@ -69,33 +211,153 @@ char *QuoteString(char *str)
     return (char *)g_strdup((gchar *)str);
 }
 
-void AddImgToList(char** strp, char* str)
+/* Add a filename to a space-separated list, quoting it if need be.
+ * The list grows in place, so building it takes time linear
+ * in its final length rather than copying it for every name.
+ */
+void AddImgToList(GString** strp, char* str)
 {
     str = QuoteString(str);
 
-    if (*strp)
-    {
-        int newsize = strlen(*strp) + strlen(str) + 2;
-        char* newstr = malloc(newsize);
-        if (!newstr) {
-            free(str);
-            *strp = 0;
-            return;
+    if (*strp) {
+        g_string_append_c(*strp, ' ');
+        g_string_append(*strp, str);
+    }
+    else
+        *strp = g_string_new(str);
+
+    /* QuoteString allocated a copy, so free that now: */
+    free(str);
+}
+
+/* --notes-format: instead of the lists PrintNotes() normally prints,
+ * print one record per image, for other programs to read:
+ *   json: a JSON object per line
+ *   tsv:  a header line, then tab-separated fields, with tab, newline
+ *         and backslash escaped as \t, \n and \\
+ *   nul:  each field ends with a NUL byte, so nothing needs escaping
+ * The fields are the filename, its rotation, its EXIF rotation,
+ * whether those differ, its note numbers separated by commas,
+ * and its caption.
+ */
+int gNotesFormat = PHO_NOTES_TEXT;
+
+static const char* sNotesFormats[] = { "text", "json", "nul", "tsv" };
+
+/* Set gNotesFormat by name. Returns 0, or -1 if there's no such format. */
+int SetNotesFormat(const char* name)
+{
+    int i;
+
+    for (i = 0; i < (int)G_N_ELEMENTS(sNotesFormats); ++i)
+        if (!strcmp(name, sNotesFormats[i])) {
+            gNotesFormat = i;
+            return 0;
+        }
+    return -1;
+}
+
+static void AppendNoteNumbers(GString* out, PhoImage* img)
+{
+    int note, first = 1;
+
+    for (note = 0; note < NUM_NOTES; ++note) {
+        if (!img->notes.words[note / NOTE_WORD_BITS]) {
+            note += NOTE_WORD_BITS - 1;     /* skip the whole word */
+            continue;
+        }
+        if (HasNote(img, note)) {
+            g_string_append_printf(out, first ? "%d" : ",%d", note);
+            first = 0;
         }
-        snprintf(newstr, newsize, "%s %s", *strp, str);
-        free(*strp);
-        *strp = newstr;
     }
-    else {
-        *strp = strdup(str);
-        if (!*strp) {
-            free(str);
-            return;
+}
+
+/* Bytes are passed through as they are, so names that aren't UTF-8
+ * won't be either.
+ */
+static void AppendJSONString(GString* out, const char* str)
+{
+    g_string_append_c(out, '"');
+    for ( ; *str; ++str) {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\') {
+            g_string_append_c(out, '\\');
+            g_string_append_c(out, c);
         }
+        else if (c == '\n')
+            g_string_append(out, "\\n");
+        else if (c == '\t')
+            g_string_append(out, "\\t");
+        else if (c < 0x20)
+            g_string_append_printf(out, "\\u%04x", c);
+        else
+            g_string_append_c(out, c);
     }
+    g_string_append_c(out, '"');
+}
 
-    /* QuoteString allocated a copy, so free that now: */
-    free(str);
+static void AppendTSVField(GString* out, const char* str)
+{
+    for ( ; *str; ++str) {
+        if (*str == '\t')
+            g_string_append(out, "\\t");
+        else if (*str == '\n')
+            g_string_append(out, "\\n");
+        else if (*str == '\\')
+            g_string_append(out, "\\\\");
+        else
+            g_string_append_c(out, *str);
+    }
+}
+
+/* Add img's record, in the given format, to out. */
+void FormatNoteRecord(GString* out, PhoImage* img, int format)
+{
+    const char* caption = img->caption ? img->caption : "";
+    int wrongExif = (img->curRot != img->exifRot);
+
+    switch (format)
+    {
+      case PHO_NOTES_JSON:
+          g_string_append(out, "{\"file\":");
+          AppendJSONString(out, img->filename);
+          g_string_append_printf(out,
+                                 ",\"rotation\":%d,\"exif_rotation\":%d"
+                                 ",\"wrong_exif\":%s,\"notes\":[",
+                                 img->curRot, img->exifRot,
+                                 wrongExif ? "true" : "false");
+          AppendNoteNumbers(out, img);
+          g_string_append(out, "],\"caption\":");
+          AppendJSONString(out, caption);
+          g_string_append(out, "}\n");
+          break;
+
+      case PHO_NOTES_TSV:
+          AppendTSVField(out, img->filename);
+          g_string_append_printf(out, "\t%d\t%d\t%d\t",
+                                 img->curRot, img->exifRot, wrongExif);
+          AppendNoteNumbers(out, img);
+          g_string_append_c(out, '\t');
+          AppendTSVField(out, caption);
+          g_string_append_c(out, '\n');
+          break;
+
+      case PHO_NOTES_NUL:
+          g_string_append(out, img->filename);
+          g_string_append_c(out, '\0');
+          g_string_append_printf(out, "%d", img->curRot);
+          g_string_append_c(out, '\0');
+          g_string_append_printf(out, "%d", img->exifRot);
+          g_string_append_c(out, '\0');
+          g_string_append_printf(out, "%d", wrongExif);
+          g_string_append_c(out, '\0');
+          AppendNoteNumbers(out, img);
+          g_string_append_c(out, '\0');
+          g_string_append(out, caption);
+          g_string_append_c(out, '\0');
+          break;
+    }
 }
 
 
@@ -107,7 +369,7 @@ void AddImgToList(char** strp, char* str)
  * that will be replaced by the current image file name.
  */
 
-static int GlobalCaptionFile()
+int GlobalCaptionFile()
 {
     char* cp;
 
@@ -128,7 +390,7 @@ static int GlobalCaptionFile()
 }
 
 /* Return the appropriate caption file name for this image */
-static char* CapFileName(PhoImage* img)
+char* CapFileName(PhoImage* img)
 {
     /* How much ram do we need for the caption filename? */
     static char buf[BUFSIZ];
@@ -159,180 +421,139 @@ static char* CapFileName(PhoImage* img)
  * If the caption file is global, though, we read the file once
  * for the first image and cache them.
  */
-void ReadCaption(PhoImage* img)
+/* The global caption file, read once into a table of
+ * filename -> caption. Strings live in sCaptionStrings.
+ */
+static GHashTable* sCaptionIndex = 0;
+static GStringChunk* sCaptionStrings = 0;
+
+/* Read the global caption file, in one pass over a mapping of it.
+ * Lines look like
+ *   imgname: caption
+ * and may be any length. If an image is listed more than once,
+ * the first caption wins.
+ */
+static void ReadCaptionIndex()
 {
-    int i;
-    int capfile;
-    char* capfilename;
-
-    static int sFirstTime = 1;
-    static int sGlobalCaptions = 0;
-    static char** sCaptionFileList = 0;
-    static char** sCaptionList = 0;
-    static int sNumCaptions = 0;
-
-    if (sFirstTime) {
-        sFirstTime = 0;
-        sGlobalCaptions = GlobalCaptionFile();
-        if (sGlobalCaptions) {
-            /* Read the global file */
-            char line[10000];
-            int numlines = 0;
-
-            FILE* capfile = fopen(gCapFileFormat, "r");
-
-            if (!capfile)    /* No captions to read, nothing to do */
-                return;
-
-            /* Make a first pass through the file just to count lines */
-            while (fgets(line, sizeof line, capfile)) {
-                char* colon = strchr(line, ':');
-                if (colon)
-                    ++numlines;
-            }
+    struct stat st;
+    const char *map, *line, *end;
+    int fd;
 
-            /* Now we can allocate space for the lists of files/captions */
-            sCaptionFileList = malloc(numlines * (sizeof (char*)));
-            sCaptionList = malloc(numlines * (sizeof (char*)));
-            if (!sCaptionFileList || !sCaptionList) {
-                perror("Out of memory reading captions");
-                fclose(capfile);
-                return;
-            }
+    sCaptionIndex = g_hash_table_new(g_str_hash, g_str_equal);
+    sCaptionStrings = g_string_chunk_new(64 * 1024);
 
-            /* and loop through again to actually read the captions */
-            rewind(capfile);
-            while (fgets(line, sizeof line, capfile)) {
-                char* cp;
-
-                /* Line should look like: imagename: blah blah */
-                char* colon = strchr(line, ':');
-                if (!colon) continue;
-
-                /* terminate the filename string */
-                *colon = '\0';
-                sCaptionFileList[sNumCaptions] = strdup(line);
-
-                /* Skip the colon and any spaces immediately after it */
-                ++colon;
-                while (*colon == ' ')
-                    ++colon;
-                /* strip off the terminal newline */
-                for (cp = colon; *cp != '\0'; ++cp)
-                    if (*cp == '\n' || *cp == '\r') {
-                        *cp = '\0';
-                        break;
-                    }
-
-                /* Now colon points to the beginning of the caption */
-                sCaptionList[sNumCaptions] = strdup(colon);
-
-                ++sNumCaptions;
-            }
-            fclose(capfile);
-        }
+    fd = open(gCapFileFormat, O_RDONLY);
+    if (fd < 0)      /* No captions to read, nothing to do */
+        return;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+    map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(gCapFileFormat);
+        return;
     }
 
-    /* Now we've done the first-time reading of the file, if needed. */
-    if (sGlobalCaptions) {
-        for (i=0; i < sNumCaptions; ++i)
-            if (!strcmp(sCaptionFileList[i], img->filename)) {
-                img->caption = sCaptionList[i];
-                return;
+    end = map + st.st_size;
+    for (line = map; line < end; ) {
+        const char *eol = memchr(line, '\n', end - line);
+        const char *colon, *cap, *capend;
+
+        if (!eol)
+            eol = end;
+
+        /* Line should look like: imagename: blah blah */
+        colon = memchr(line, ':', eol - line);
+        if (colon) {
+            char* name = g_string_chunk_insert_len(sCaptionStrings, line,
+                                                   colon - line);
+            if (!g_hash_table_lookup(sCaptionIndex, name)) {
+                /* Skip the colon and any spaces immediately after it,
+                 * and stop at a CR, if it has one.
+                 */
+                for (cap = colon + 1; cap < eol && *cap == ' '; ++cap)
+                    ;
+                capend = memchr(cap, '\r', eol - cap);
+                if (!capend)
+                    capend = eol;
+                g_hash_table_insert(sCaptionIndex, name,
+                                    g_string_chunk_insert_len(sCaptionStrings,
+                                                              cap,
+                                                              capend - cap));
             }
-        img->caption = 0;
-        return;
+        }
+        line = eol + 1;
     }
+    munmap((void*)map, st.st_size);
 
-    /* If we get here, caption files are per-image.
-     * So look for the appropriate caption file.
-     */
+    if (gDebug)
+        printf("Read %u captions from %s\n",
+               g_hash_table_size(sCaptionIndex), gCapFileFormat);
+}
 
-    capfilename = CapFileName(img);
-    if (!capfilename)
-        return;
+void ReadCaption(PhoImage* img)
+{
+    char* caption;
 
-    capfile = open(capfilename, O_RDONLY);
-    if (capfile < 0)
+    if (!gCapFileFormat)
         return;
-    printf("Reading caption from %s\n", capfilename);
 
-#define MAX_CAPTION 1023
-    img->caption = calloc(1, MAX_CAPTION);
-    if (!(img->caption)) {
-        perror("Couldn't allocate memory for caption");
-        close(capfile);
+    /* Per-image caption files are read in the background */
+    if (!GlobalCaptionFile()) {
+        LoadCaptionFile(img);
         return;
-    } 
-    read(capfile, img->caption, MAX_CAPTION-1);
-    for (i=0; i < MAX_CAPTION && img->caption[i] != 0; ++i) {
-        if (img->caption[i] == '\n') {
-            img->caption[i] = ' ';
-        }
     }
-    close(capfile);
-    if (gDebug)
-        fprintf(stderr, "Read caption file %s\n", capfilename);
+
+    caption = (char*)IndexedCaption(img->filename);
+    img->caption = PoolString(caption);
+}
+
+/* What the global caption file said about filename when it was read */
+const char* IndexedCaption(const char* filename)
+{
+    if (!sCaptionIndex)
+        ReadCaptionIndex();
+    return g_hash_table_lookup(sCaptionIndex, filename);
 }
 
 /* Finally, the routine that prints a summary to a file or stdout */
+static int ComparePositions(gconstpointer a, gconstpointer b)
+{
+    return *(const int*)a - *(const int*)b;
+}
+
+/* Everything is listed in the order it was shown, which under -R
+ * isn't the order of gImageList.
+ */
 void PrintNotes()
 {
-    int i;
-    char *rot90=0, *rot180=0, *rot270=0, *rot0=0, *unmatchExif=0;
+    int i, pos;
+    GString *rot90=0, *rot180=0, *rot270=0, *rot0=0, *unmatchExif=0;
     PhoImage *img;
-    FILE *capfile = 0;
-    int useGlobalCaptionFile = GlobalCaptionFile();
-
-    /* Should free up memory here, e.g. for sFlagFileList,
-     * but since this is only called right before exit,
-     * it's never been allocated so it doesn't matter.
-     * If PrintNotes ever gets called except at exit,
-     * this will leak.
-     */
+    GString *record = 0;
+    GArray *positions = 0;
+
+    if (gNotesFormat != PHO_NOTES_TEXT) {
+        record = g_string_sized_new(1024);
+        if (gNotesFormat == PHO_NOTES_TSV)
+            fputs("file\trotation\texif_rotation\twrong_exif\tnotes\tcaption\n",
+                  stdout);
+    }
 
-    img = gFirstImage;
-    while (img)
+    for (pos = 0; pos < gNumImages; ++pos)
     {
-        if (img->caption && img->caption[0] && gCapFileFormat) {
-            if (gDebug)
-                printf("Caption %s: %s\n", img->filename, img->caption);
-
-            /* If we have a global captions file and we haven't
-             * opened it yet, do so now.
-             */
-            if (useGlobalCaptionFile && gCapFileFormat && !capfile) {
-                capfile = fopen(gCapFileFormat, "w");
-                if (!capfile) {
-                    perror(gCapFileFormat);
-                    gCapFileFormat = 0;  /* don't try again to write to it */
-                }
-            }
-
-            if (capfile) {    /* One shared caption file */
-                /* capfile is already open, so append to it: */
-                fprintf(capfile, "%s: %s\n\n", img->filename, img->caption);
-
-            } else if (gCapFileFormat) {   /* need individual caption files */
-                char* capname = CapFileName(img);
-                if (capname) {
-                    capfile = fopen(capname, "w");
-                    if (capfile) {
-                        fputs(img->caption, capfile);
-                        fclose(capfile);
-                        capfile = 0;
-                    }
-                    else
-                        perror(capname);
-                }
-            }
-	}
-        if (img->noteFlags)
-        {
-            int flag, j;
-            for (j=0, flag=1; j<NUM_NOTES; ++j, flag <<= 1)
-                if (img->noteFlags & flag)
-                    AddImgToList(sFlagFileList+j, img->filename);
+        img = ImageAtPosition(pos);
+        if (!img)
+            continue;
+
+        /* Records go out as we go, rather than being collected */
+        if (record) {
+            g_string_truncate(record, 0);
+            FormatNoteRecord(record, img, gNotesFormat);
+            fwrite(record->str, 1, record->len, stdout);
+            continue;
         }
 
         switch (img->curRot)
@@ -363,37 +584,66 @@ void PrintNotes()
          */
         if (img->curRot != img->exifRot)
             AddImgToList(&unmatchExif, img->filename);
-
-        img = img->next;
-        /* Have we looped back to the beginning?*/
-        if (img == gFirstImage) break;
     }
 
-    if (capfile)
-        fclose(capfile);
+    if (record) {
+        g_string_free(record, TRUE);
+        fflush(stdout);
+        return;
+    }
 
     /* Now we've looped over all the structs, so we can print out
      * the tables of rotation and notes.
      */
     if (rot90)
-        printf("\nRotate 90 (CW): %s\n", rot90);
+        printf("\nRotate 90 (CW): %s\n", rot90->str);
     if (rot270)
-        printf("\nRotate -90 (CCW): %s\n", rot270);
+        printf("\nRotate -90 (CCW): %s\n", rot270->str);
     if (rot180)
-        printf("\nRotate 180: %s\n", rot180);
+        printf("\nRotate 180: %s\n", rot180->str);
     if (rot0)
-        printf("\nRotate 0 (wrong EXIF): %s\n", rot0);
+        printf("\nRotate 0 (wrong EXIF): %s\n", rot0->str);
     if (unmatchExif)
-        printf("\nWrong EXIF: %s\n", unmatchExif);
+        printf("\nWrong EXIF: %s\n", unmatchExif->str);
+    positions = g_array_new(FALSE, FALSE, sizeof (int));
     for (i=0; i < NUM_NOTES; ++i)
-        if (sFlagFileList[i])
+    {
+        /* The note index has each note's images in list order;
+         * put them in the order they were shown.
+         */
+        GString* noteList = 0;
+        const int* indices;
+        int count, j;
+
+        indices = NoteImages(i, &count);
+        g_array_set_size(positions, 0);
+        for (j = 0; j < count; ++j) {
+            pos = IndexToPosition(indices[j]);
+            g_array_append_val(positions, pos);
+        }
+        g_array_sort(positions, ComparePositions);
+        for (j = 0; j < count; ++j) {
+            img = ImageAtPosition(g_array_index(positions, int, j));
+            if (img)
+                AddImgToList(&noteList, img->filename);
+        }
+        if (noteList)
         {
             char* keyword = KeywordString(i);
             if (keyword && *keyword)
                 printf("\n%s: ", keyword);
             else
                 printf("\nNote %d: ", i);
-            printf("%s\n", sFlagFileList[i]);
+            printf("%s\n", noteList->str);
+            g_string_free(noteList, TRUE);
         }
+    }
     printf("\n");
+
+    g_array_free(positions, TRUE);
+    if (rot90) g_string_free(rot90, TRUE);
+    if (rot180) g_string_free(rot180, TRUE);
+    if (rot270) g_string_free(rot270, TRUE);
+    if (rot0) g_string_free(rot0, TRUE);
+    if (unmatchExif) g_string_free(unmatchExif, TRUE);
 }
@@ -0,0 +1,381 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * imgfilter.c: show only the images that match a filter expression.
+ *
+ * Copyright 2010 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+/* A filter expression is a list of terms. Terms separated by spaces
+ * must all match; commas separate alternatives. A term is a note
+ * number (0-9, or higher for keywords) or one of the words below,
+ * optionally preceded by ! to mean "not". For example,
+ *    3 !rotated, 5
+ * matches images with note 3 that aren't rotated, plus any with note 5.
+ *
+ * The filter's view is just a sorted array of the positions (in the
+ * order images are shown) of matching images. It's built once when
+ * the filter is set, then kept up to date one image at a time as
+ * images are added, removed, flagged or rotated; nothing is copied
+ * or reloaded. NextPosition() and PrevPosition() step through it.
+ */
+
+#include "pho.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+/* Image properties a filter can test, besides note flags */
+#define FILTER_ROTATED   0x01
+#define FILTER_PORTRAIT  0x02
+#define FILTER_LANDSCAPE 0x04
+#define FILTER_COMMENT   0x08
+#define FILTER_CAPTION   0x10
+#define FILTER_SEEN      0x20
+
+static struct {
+    char* name;
+    unsigned int prop;
+} sFilterWords[] = {
+    { "rotated",   FILTER_ROTATED },     /* will be listed for rotation */
+    { "portrait",  FILTER_PORTRAIT },    /* as currently rotated */
+    { "landscape", FILTER_LANDSCAPE },
+    { "comment",   FILTER_COMMENT },
+    { "caption",   FILTER_CAPTION },
+    { "seen",      FILTER_SEEN },        /* has been shown at least once */
+    { 0, 0 }
+};
+
+/* One alternative: everything in the On masks and nothing in the Off */
+typedef struct {
+    NoteSet notesOn, notesOff;
+    unsigned int propsOn, propsOff;
+    int used;           /* has any terms */
+} FilterClause;
+
+static char* sFilterExpr = 0;       /* 0 when not filtering */
+static FilterClause* sClauses = 0;
+static int sNumClauses = 0;
+
+/* Positions of matching images, in increasing order */
+static int* sView = 0;
+static int sViewLen = 0;
+static int sViewSize = 0;
+
+static unsigned int ImageProps(PhoImage* img)
+{
+    unsigned int props = 0;
+
+    if (img->curRot != 0)
+        props |= FILTER_ROTATED;
+    /* Orientation is only known once the image has been loaded */
+    if (img->trueWidth > 0) {
+        props |= FILTER_SEEN;
+        if (img->curHeight > img->curWidth)
+            props |= FILTER_PORTRAIT;
+        else
+            props |= FILTER_LANDSCAPE;
+    }
+    if (img->comment && img->comment[0])
+        props |= FILTER_COMMENT;
+    if (img->caption && img->caption[0])
+        props |= FILTER_CAPTION;
+    return props;
+}
+
+static int NotesMatch(const NoteSet* notes, FilterClause* c)
+{
+    int w;
+
+    for (w = 0; w < NOTE_WORDS; ++w)
+        if ((notes->words[w] & c->notesOn.words[w]) != c->notesOn.words[w]
+            || (notes->words[w] & c->notesOff.words[w]))
+            return 0;
+    return 1;
+}
+
+static int MatchesFilter(PhoImage* img)
+{
+    unsigned int props = ImageProps(img);
+    int i;
+
+    for (i = 0; i < sNumClauses; ++i) {
+        FilterClause* c = sClauses + i;
+        if ((props & c->propsOn) == c->propsOn
+            && !(props & c->propsOff)
+            && NotesMatch(&img->notes, c))
+            return 1;
+    }
+    return 0;
+}
+
+/* Parse expr into clauses. Returns the number of clauses,
+ * or -1 (after printing why) if expr doesn't make sense.
+ */
+static int ParseFilter(const char* expr, FilterClause** clausesp)
+{
+    FilterClause* clauses = calloc(strlen(expr) / 2 + 2, sizeof *clauses);
+    int n = 0;
+    const char* p = expr;
+
+    if (!clauses)
+        return -1;
+
+    while (*p) {
+        FilterClause* c = clauses + n;
+        int negate = 0, len, i;
+        char word[32];
+
+        if (isspace((unsigned char)*p)) {
+            ++p;
+            continue;
+        }
+        if (*p == ',') {
+            /* Ignore empty alternatives */
+            if (c->used)
+                ++n;
+            ++p;
+            continue;
+        }
+
+        if (*p == '!') {
+            negate = 1;
+            ++p;
+        }
+        for (len = 0; isalnum((unsigned char)p[len]); ++len)
+            ;
+        if (len == 0 || len >= (int)sizeof word) {
+            fprintf(stderr, "Bad filter term at '%s'\n", p);
+            free(clauses);
+            return -1;
+        }
+        memcpy(word, p, len);
+        word[len] = '\0';
+        p += len;
+
+        if (isdigit((unsigned char)word[0])) {
+            NoteSet* set = negate ? &c->notesOff : &c->notesOn;
+            char* end;
+            long note = strtol(word, &end, 10);
+            if (*end || note < 0 || note >= NUM_NOTES) {
+                fprintf(stderr, "No note number %s\n", word);
+                free(clauses);
+                return -1;
+            }
+            set->words[note / NOTE_WORD_BITS]
+                |= (guint64)1 << (note % NOTE_WORD_BITS);
+            c->used = 1;
+            continue;
+        }
+
+        for (i = 0; sFilterWords[i].name; ++i)
+            if (!strcasecmp(word, sFilterWords[i].name))
+                break;
+        if (!sFilterWords[i].name) {
+            fprintf(stderr, "Unknown filter term '%s'\n", word);
+            free(clauses);
+            return -1;
+        }
+        if (negate)
+            c->propsOff |= sFilterWords[i].prop;
+        else
+            c->propsOn |= sFilterWords[i].prop;
+        c->used = 1;
+    }
+
+    if (clauses[n].used)
+        ++n;
+    *clausesp = clauses;
+    return n;
+}
+
+/* Where pos is, or would go, in sView */
+static int ViewSlot(int pos)
+{
+    int lo = 0, hi = sViewLen;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (sView[mid] < pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void ViewInsert(int pos)
+{
+    int slot = ViewSlot(pos);
+
+    if (slot < sViewLen && sView[slot] == pos)
+        return;
+    if (sViewLen >= sViewSize) {
+        int newsize = sViewSize ? sViewSize * 2 : 64;
+        int* newview = realloc(sView, newsize * sizeof (int));
+        if (!newview) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(1);
+        }
+        sView = newview;
+        sViewSize = newsize;
+    }
+    memmove(sView + slot + 1, sView + slot, (sViewLen - slot) * sizeof (int));
+    sView[slot] = pos;
+    ++sViewLen;
+}
+
+static void ViewRemove(int pos)
+{
+    int slot = ViewSlot(pos);
+
+    if (slot >= sViewLen || sView[slot] != pos)
+        return;
+    memmove(sView + slot, sView + slot + 1,
+            (sViewLen - slot - 1) * sizeof (int));
+    --sViewLen;
+}
+
+/* Build the view from scratch, e.g. after the order has changed */
+void RebuildFilterView()
+{
+    int pos;
+
+    sViewLen = 0;
+    if (!sFilterExpr)
+        return;
+    for (pos = 0; pos < gNumImages; ++pos) {
+        PhoImage* img = ImageAtPosition(pos);
+        if (img && MatchesFilter(img))
+            ViewInsert(pos);
+    }
+}
+
+/* Show only images matching expr; an empty or null expr shows them all.
+ * Returns the number of matching images (or CountImages() if there's
+ * no filter), or -1 if expr couldn't be parsed, leaving the old filter.
+ */
+int SetImageFilter(const char* expr)
+{
+    FilterClause* clauses = 0;
+    int n;
+
+    while (expr && isspace((unsigned char)*expr))
+        ++expr;
+
+    if (!expr || !*expr) {
+        free(sFilterExpr);
+        free(sClauses);
+        sFilterExpr = 0;
+        sClauses = 0;
+        sNumClauses = 0;
+        sViewLen = 0;
+        return CountImages();
+    }
+
+    n = ParseFilter(expr, &clauses);
+    if (n < 0)
+        return -1;
+
+    free(sFilterExpr);
+    free(sClauses);
+    sFilterExpr = strdup(expr);
+    sClauses = clauses;
+    sNumClauses = n;
+    RebuildFilterView();
+    return sViewLen;
+}
+
+/* The current filter expression, or 0 if there's no filter */
+const char* ImageFilter()
+{
+    return sFilterExpr;
+}
+
+/* How many images match the filter */
+int FilterCount()
+{
+    return sFilterExpr ? sViewLen : CountImages();
+}
+
+/* Where pos comes among the matching images (counting from 0),
+ * or -1 if it doesn't match.
+ */
+int FilterRank(int pos)
+{
+    int slot;
+
+    if (!sFilterExpr)
+        return pos;
+    slot = ViewSlot(pos);
+    return (slot < sViewLen && sView[slot] == pos) ? slot : -1;
+}
+
+/* Call whenever anything a filter might test has changed in img */
+void FilterImageChanged(PhoImage* img)
+{
+    int index;
+
+    if (!sFilterExpr || !img)
+        return;
+    index = IndexOfImage(img);
+    if (index < 0)
+        return;
+    if (MatchesFilter(img))
+        ViewInsert(IndexToPosition(index));
+    else
+        ViewRemove(IndexToPosition(index));
+}
+
+/* Call when an image is added to, or removed from, the list */
+void FilterImageAdded(int index)
+{
+    PhoImage* img = ImageAt(index);
+
+    if (sFilterExpr && img && MatchesFilter(img))
+        ViewInsert(IndexToPosition(index));
+}
+
+void FilterImageRemoved(int index)
+{
+    if (sFilterExpr)
+        ViewRemove(IndexToPosition(index));
+}
+
+/* The first position after pos of an image that's still in the list
+ * and matches the filter, or -1 if there isn't one.
+ * pos can be -1, to start from the beginning.
+ */
+int NextPosition(int pos)
+{
+    int slot;
+
+    if (!sFilterExpr) {
+        for (++pos; pos < gNumImages; ++pos)
+            if (ImageAtPosition(pos))
+                return pos;
+        return -1;
+    }
+
+    slot = ViewSlot(pos + 1);
+    return slot < sViewLen ? sView[slot] : -1;
+}
+
+/* The last matching position before pos, or -1. */
+int PrevPosition(int pos)
+{
+    int slot;
+
+    if (!sFilterExpr) {
+        for (--pos; pos >= 0; --pos)
+            if (ImageAtPosition(pos))
+                return pos;
+        return -1;
+    }
+
+    slot = ViewSlot(pos);
+    return slot > 0 ? sView[slot-1] : -1;
+}
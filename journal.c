@@ -0,0 +1,373 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * journal.c: keep a running record of notes, rotations, captions
+ * and comments, so a crash doesn't lose them.
+ *
+ * Copyright 2010 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+/* With --journal file, every change is appended to the file as one
+ * line, as it's made:
+ *    note <tab> N <tab> 0|1 <tab> filename
+ *    rot <tab> degrees <tab> filename
+ *    caption <tab> filename <tab> text
+ *    comment <tab> filename <tab> text
+ * with strings escaped as in C, so tabs and newlines can't confuse it.
+ *
+ * Lines are formatted on the main thread, but written by a separate
+ * thread, which fsyncs after each batch (whatever arrives within
+ * JOURNAL_BATCH_MILLIS of the first line) so the display never waits
+ * for the disk.
+ *
+ * When pho starts with an existing journal, it's read once into a
+ * table of the final state of each file mentioned, and each image
+ * gets its state from the table as it's added to the list, so
+ * restoring takes time in proportion to the journal, not the list.
+ */
+
+#include "pho.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/* How long to wait for more records before syncing a batch */
+#define JOURNAL_BATCH_MILLIS 200
+
+/* What the journal says about one file */
+typedef struct {
+    NoteSet notesOn, notesOff;
+    int haveRot;
+    int rot;
+    char* caption;
+    char* comment;
+} JournalState;
+
+static int sJournalFd = -1;
+static char* sJournalName = 0;
+static GAsyncQueue* sJournalQueue = 0;
+static GThread* sJournalThread = 0;
+
+/* Pushed to tell the writer to finish up */
+static char sJournalEnd;
+
+/* filename -> JournalState, from the journal as it was at startup */
+static GHashTable* sJournalStates = 0;
+
+/* Don't journal the changes we make while restoring them */
+static int sRestoring = 0;
+
+static void FreeJournalState(gpointer data)
+{
+    JournalState* st = data;
+    g_free(st->caption);
+    g_free(st->comment);
+    g_free(st);
+}
+
+static int WriteAll(int fd, const char* buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* The writer thread: write records as they come, syncing each batch */
+static gpointer JournalWriter(gpointer data)
+{
+    int done = 0, failed = 0;
+
+    while (!done) {
+        char* rec = g_async_queue_pop(sJournalQueue);
+        gint64 deadline = g_get_monotonic_time()
+            + JOURNAL_BATCH_MILLIS * 1000;
+
+        while (rec) {
+            gint64 wait;
+            if (rec == &sJournalEnd) {
+                done = 1;
+                break;
+            }
+            if (WriteAll(sJournalFd, rec, strlen(rec)) < 0 && !failed) {
+                perror(sJournalName);
+                failed = 1;
+            }
+            g_free(rec);
+            wait = deadline - g_get_monotonic_time();
+            rec = (wait > 0 ? g_async_queue_timeout_pop(sJournalQueue, wait)
+                            : g_async_queue_try_pop(sJournalQueue));
+        }
+
+        if (fdatasync(sJournalFd) < 0 && !failed) {
+            perror(sJournalName);
+            failed = 1;
+        }
+    }
+    return 0;
+}
+
+/* Queue a record for the writer; takes ownership of rec */
+static void JournalRecord(char* rec)
+{
+    if (gDebug)
+        printf("Journal: %s", rec);
+    g_async_queue_push(sJournalQueue, rec);
+}
+
+static int Journaling()
+{
+    return sJournalFd >= 0 && !sRestoring;
+}
+
+void JournalNote(PhoImage* img, int note, int on)
+{
+    char* name;
+
+    if (!Journaling())
+        return;
+    name = g_strescape(img->filename, 0);
+    JournalRecord(g_strdup_printf("note\t%d\t%d\t%s\n", note, on ? 1 : 0,
+                                  name));
+    g_free(name);
+}
+
+void JournalRotation(PhoImage* img)
+{
+    char* name;
+
+    if (!Journaling() || !img)
+        return;
+    name = g_strescape(img->filename, 0);
+    JournalRecord(g_strdup_printf("rot\t%d\t%s\n", img->curRot, name));
+    g_free(name);
+}
+
+static void JournalText(const char* what, PhoImage* img, const char* text)
+{
+    char *name, *esc;
+
+    if (!Journaling())
+        return;
+    name = g_strescape(img->filename, 0);
+    esc = g_strescape(text ? text : "", 0);
+    JournalRecord(g_strdup_printf("%s\t%s\t%s\n", what, name, esc));
+    g_free(name);
+    g_free(esc);
+}
+
+void JournalCaption(PhoImage* img)
+{
+    JournalText("caption", img, img->caption);
+}
+
+void JournalComment(PhoImage* img)
+{
+    JournalText("comment", img, img->comment);
+}
+
+static JournalState* StateFor(char* escname)
+{
+    char* name = g_strcompress(escname);
+    JournalState* st = g_hash_table_lookup(sJournalStates, name);
+
+    if (st)
+        g_free(name);
+    else {
+        st = g_new0(JournalState, 1);
+        g_hash_table_insert(sJournalStates, name, st);
+    }
+    return st;
+}
+
+/* Fold one journal line into sJournalStates; ignore anything garbled */
+static void ReplayLine(char* line)
+{
+    char** fields = g_strsplit(line, "\t", 4);
+    int n = g_strv_length(fields);
+    JournalState* st;
+
+    if (n == 4 && !strcmp(fields[0], "note")) {
+        int note = atoi(fields[1]);
+        if (note >= 0 && note < NUM_NOTES) {
+            guint64 bit = (guint64)1 << (note % NOTE_WORD_BITS);
+            int w = note / NOTE_WORD_BITS;
+            st = StateFor(fields[3]);
+            if (atoi(fields[2])) {
+                st->notesOn.words[w] |= bit;
+                st->notesOff.words[w] &= ~bit;
+            }
+            else {
+                st->notesOff.words[w] |= bit;
+                st->notesOn.words[w] &= ~bit;
+            }
+        }
+    }
+    else if (n == 3 && !strcmp(fields[0], "rot")) {
+        st = StateFor(fields[2]);
+        st->haveRot = 1;
+        st->rot = atoi(fields[1]);
+    }
+    else if (n == 3 && !strcmp(fields[0], "caption")) {
+        st = StateFor(fields[1]);
+        g_free(st->caption);
+        st->caption = g_strcompress(fields[2]);
+    }
+    else if (n == 3 && !strcmp(fields[0], "comment")) {
+        st = StateFor(fields[1]);
+        g_free(st->comment);
+        st->comment = g_strcompress(fields[2]);
+    }
+    else if (gDebug)
+        printf("Skipping journal line '%s'\n", line);
+
+    g_strfreev(fields);
+}
+
+/* Read what's already in the journal.
+ * Returns 1 if it ends in a partial line, else 0.
+ */
+static int ReplayJournal(const char* filename)
+{
+    FILE* fp = fopen(filename, "r");
+    char* line = 0;
+    size_t size = 0;
+    ssize_t len;
+    int partial = 0, nlines = 0;
+
+    if (!fp)
+        return 0;
+
+    while ((len = getline(&line, &size, fp)) > 0) {
+        /* A last line with no newline was cut short, so skip it */
+        partial = (line[len-1] != '\n');
+        if (partial)
+            break;
+        line[len-1] = '\0';
+        ReplayLine(line);
+        ++nlines;
+    }
+    free(line);
+    fclose(fp);
+
+    if (gDebug)
+        printf("Read %d journal records for %d files from %s\n", nlines,
+               g_hash_table_size(sJournalStates), filename);
+    return partial;
+}
+
+/* Give img whatever notes, rotation, caption and comment the journal
+ * had for it when pho started.
+ */
+void JournalRestore(PhoImage* img)
+{
+    JournalState* st;
+    int w, b;
+
+    if (!sJournalStates || !img
+        || !(st = g_hash_table_lookup(sJournalStates, img->filename)))
+        return;
+
+    sRestoring = 1;
+    for (w = 0; w < NOTE_WORDS; ++w) {
+        if (!st->notesOn.words[w] && !st->notesOff.words[w])
+            continue;
+        for (b = 0; b < NOTE_WORD_BITS; ++b) {
+            guint64 bit = (guint64)1 << b;
+            if (st->notesOn.words[w] & bit)
+                SetNote(img, w * NOTE_WORD_BITS + b, 1);
+            else if (st->notesOff.words[w] & bit)
+                SetNote(img, w * NOTE_WORD_BITS + b, 0);
+        }
+    }
+    if (st->haveRot) {
+        img->curRot = st->rot;
+        MarkXmpDirty(img);
+    }
+    if (st->caption) {
+        img->caption = PoolString(st->caption);
+        /* It may never have made it to the caption file */
+        MarkCaptionDirty(img);
+        MarkXmpDirty(img);
+    }
+    if (st->comment)
+        img->comment = PoolString(st->comment);
+    sRestoring = 0;
+
+    FilterImageChanged(img);
+}
+
+/* Did the journal say how img should be rotated? If so, that wins
+ * over its EXIF rotation.
+ */
+int JournalHasRotation(PhoImage* img)
+{
+    JournalState* st;
+
+    if (!sJournalStates || !img
+        || !(st = g_hash_table_lookup(sJournalStates, img->filename)))
+        return 0;
+    return st->haveRot;
+}
+
+/* Restore what's in filename, and record any new changes there. */
+void OpenJournal(const char* filename)
+{
+    int index, partial;
+
+    if (sJournalFd >= 0) {
+        fprintf(stderr, "Only one --journal allowed\n");
+        Usage();
+    }
+
+    if (sJournalStates)
+        g_hash_table_destroy(sJournalStates);
+    sJournalStates = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                           g_free, FreeJournalState);
+    partial = ReplayJournal(filename);
+
+    sJournalFd = open(filename, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+                      0644);
+    if (sJournalFd < 0) {
+        perror(filename);
+        exit(1);
+    }
+    /* Don't let new records run onto the end of a cut-off one */
+    if (partial)
+        WriteAll(sJournalFd, "\n", 1);
+
+    g_free(sJournalName);
+    sJournalName = g_strdup(filename);
+    sJournalQueue = g_async_queue_new();
+    sJournalThread = g_thread_new("journal", JournalWriter, 0);
+
+    /* Catch up any images that were added before the journal was opened */
+    for (index = 0; index < gNumImages; ++index)
+        JournalRestore(ImageAt(index));
+}
+
+/* Write out anything still queued, and wait until it's on disk. */
+void CloseJournal()
+{
+    if (sJournalFd < 0)
+        return;
+
+    g_async_queue_push(sJournalQueue, &sJournalEnd);
+    g_thread_join(sJournalThread);
+    sJournalThread = 0;
+    g_async_queue_unref(sJournalQueue);
+    sJournalQueue = 0;
+    close(sJournalFd);
+    sJournalFd = -1;
+}
@@ -40,26 +40,27 @@ void ToggleKeywordsMode()
 /* Make sure we remember any changes that have been made in the dialog */
 void RememberKeywords()
 {
-    int i, mask, flags;
+    int i;
 
     if (!sLastImage)
         return;
 
-    flags = 0;
-    for (i=0, mask=1; i < NUM_NOTES; ++i, mask <<= 1)
-    {
-        if (KeywordsDToggle[i] &&
-            gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(KeywordsDToggle[i])))
-            flags |= mask;
-    }
-
-    sLastImage->noteFlags = flags;
+    for (i=0; i < NUM_NOTES; ++i)
+        SetNote(sLastImage, i, KeywordsDToggle[i] &&
+                gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(KeywordsDToggle[i])));
 
     /* and save a caption, if any */
-    if (sLastImage->caption)
-        free(sLastImage->caption);
     const gchar* caption_text = gtk_entry_get_text((GtkEntry*)KeywordsCaption);
-    sLastImage->caption = caption_text ? strdup((char*)caption_text) : NULL;
+    if (!caption_text)
+        caption_text = "";
+    if (strcmp(sLastImage->caption ? sLastImage->caption : "", caption_text)) {
+        sLastImage->caption = PoolString(caption_text);
+        JournalCaption(sLastImage);
+        MarkCaptionDirty(sLastImage);
+        MarkXmpDirty(sLastImage);
+    }
+
+    FilterImageChanged(sLastImage);
 }
 
 /* When deleting an image, we need to clear any notion of sLastImage
@@ -81,7 +82,7 @@ void UpdateKeywordsDialog()
 {
     char buffer[256];
     char* s;
-    int i, mask, flags;
+    int i;
 
     if (!gCurImage || !KeywordsDialog || gDisplayMode != PHO_DISPLAY_KEYWORDS)
         return;
@@ -98,14 +99,28 @@ void UpdateKeywordsDialog()
     gtk_label_set_text(GTK_LABEL(KeywordsDImgName), gCurImage->filename);
 
     /* Update the flags fields */
-    flags = gCurImage->noteFlags;
-    for (i=0, mask=1; i < NUM_NOTES; ++i, mask <<= 1)
+    for (i=0; i < NUM_NOTES; ++i)
     {
         if (KeywordsDToggle[i])
-            SetKeywordsDialogToggle(i, flags & mask);
+            SetKeywordsDialogToggle(i, HasNote(gCurImage, i));
     }
 }
 
+/* img's caption has just been read: show it, if img is the one
+ * in the dialog and nothing's been typed in the caption field yet.
+ */
+void ShowKeywordsCaption(PhoImage* img)
+{
+    const gchar* text;
+
+    if (!img || img != sLastImage || !IsVisible(KeywordsDialog))
+        return;
+    text = gtk_entry_get_text(GTK_ENTRY(KeywordsCaption));
+    if (!text || !*text)
+        gtk_entry_set_text(GTK_ENTRY(KeywordsCaption),
+                           img->caption ? img->caption : "");
+}
+
 char* KeywordString(int notenum)
 {
     if (! KeywordsDEntry[notenum])
@@ -201,7 +216,7 @@ static void AddNewKeywordField()
     }
 
     /* If we got here, we've overflowed */
-    sprintf(buf, "That's all: sorry, only %ld keywords at once", NUM_NOTES);
+    sprintf(buf, "That's all: sorry, only %d keywords at once", NUM_NOTES);
     label = gtk_label_new(buf);
     gtk_box_pack_start(GTK_BOX(KeywordsContainer), label, TRUE, TRUE, 4);
     gtk_widget_show(label);
@@ -16,10 +16,10 @@
 #include <string.h>
 #include <unistd.h>    /* for unlink() */
 #include <fcntl.h>     /* for symbols like O_RDONLY */
+#include <math.h>      /* for isfinite() */
 
 /* ************* Definition of globals ************ */
-PhoImage* gFirstImage = 0;
-PhoImage* gCurImage = 0;
+/* (The image list globals live in phoimglist.c) */
 
 /* Monitor resolution */
 int gMonitorWidth = 0;
@@ -46,7 +46,79 @@ int gPendingTimeout = 0;
 /* Loop back to the first image after showing the last one */
 int gRepeat = 0;
 
+/* Device pixels per logical pixel on the monitor pho is showing on.
+ * Window sizes and img->curWidth/curHeight are in logical pixels,
+ * but gImage is rendered at device resolution, so on a HiDPI screen
+ * an image isn't scaled down only for the compositor to scale it back
+ * up. trueWidth/trueHeight are the image's own pixels, and at full
+ * size, each of those is one device pixel.
+ */
+int gScaleFactor = 1;
+
+/* A size in device pixels, in logical pixels, rounding up */
+static int LogicalPixels(int device)
+{
+    return (device + gScaleFactor - 1) / gScaleFactor;
+}
+
 static int RotateImage(PhoImage* img, int degrees);    /* forward */
+static int LoadImageFromFile(PhoImage* img);           /* forward */
+static int DoScaleAndRotate(PhoImage* img, int degrees); /* forward */
+
+/* The render pipeline. Changes to the current image -- a new image,
+ * a new scale mode or screen size, a rotation -- don't do the work
+ * themselves: they mark what needs redoing with RequestRender(), and
+ * it's all done once, by CommitRender(), which runs before the next
+ * frame is drawn (or sooner, for callers that need the result right
+ * away). However many steps of a navigation ask for it, the image is
+ * decoded, resampled and painted at most once; with -d, the counts
+ * for each navigation are printed to show it.
+ *
+ * Decoding is the exception: it's done as soon as an image is chosen,
+ * since whether it decodes decides which image is shown.
+ */
+static int sRenderDirty = 0;
+static guint sRenderIdle = 0;
+
+/* The image gImage's pixels belong to, and the rotation they have.
+ * img->curRot is the rotation asked for, which the pixels catch up
+ * to on the next commit.
+ */
+static PhoImage* sPixelImg = 0;
+static int sPixelRot = 0;
+
+PhoRenderStats gRenderStats;
+static PhoRenderStats sNavStats;    /* the counts when it started */
+
+static gboolean RenderIdle(gpointer data)
+{
+    sRenderIdle = 0;
+    CommitRender();
+    return FALSE;
+}
+
+/* Mark parts of the current image's rendering as needing to be redone */
+void RequestRender(int flags)
+{
+    sRenderDirty |= flags;
+    if (!sRenderIdle)
+        sRenderIdle = g_idle_add_full(G_PRIORITY_HIGH_IDLE,
+                                      RenderIdle, 0, 0);
+}
+
+/* A new navigation is starting: report on the last one */
+static void CountNavigation()
+{
+    if (gDebug && gRenderStats.commits != sNavStats.commits)
+        printf("Render: %lu decodes, %lu resamples, %lu rotations, "
+               "%lu paints in %lu commits\n",
+               gRenderStats.decodes - sNavStats.decodes,
+               gRenderStats.resamples - sNavStats.resamples,
+               gRenderStats.rotations - sNavStats.rotations,
+               gRenderStats.paints - sNavStats.paints,
+               gRenderStats.commits - sNavStats.commits);
+    sNavStats = gRenderStats;
+}
 
 static gint DelayTimer(gpointer data)
 {
@@ -56,20 +128,26 @@ static gint DelayTimer(gpointer data)
     if (gDebug) printf("-- Timer fired\n");
     gPendingTimeout = 0;
 
+    TakeTransitionSnapshot();
     NextImage();
+    CommitRender();
+    StartTransition();
     return FALSE;       /* cancel the timer */
 }
 
 int ShowImage()
 {
     if (!gCurImage) return -1;
-    ScaleAndRotate(gCurImage, 0);
+    RequestRender(PHO_RENDER_SCALE | PHO_RENDER_WINDOW);
     /* Keywords dialog will be updated if necessary from DrawImage */
 
     if (gDelayMillis > 0 && gPendingTimeout == 0
-        && (gCurImage->next != 0 && gCurImage->next != gFirstImage)) {
+        && NextPosition(CurrentPosition()) >= 0) {
         if (gDebug) printf("Adding timeout for %d msec\n", gDelayMillis);
         gPendingTimeout = g_timeout_add (gDelayMillis, DelayTimer, 0);
+
+        /* Decode the next one meanwhile, so it's ready on time */
+        PrefetchImage(PositionToIndex(NextPosition(CurrentPosition())));
     }
 
     return 0;
@@ -118,6 +196,7 @@ static int LoadImageFromFile(PhoImage* img)
 {
     GError* err = NULL;
     int rot;
+    int trueWidth = 0, trueHeight = 0;
 
     if (!img)
         return -1;
@@ -139,19 +218,34 @@ static int LoadImageFromFile(PhoImage* img)
         g_object_unref(gImage);
         gImage = 0;
     }
+    sPixelImg = 0;
 
-    gImage = gdk_pixbuf_new_from_file(img->filename, &err);
-    if (!gImage)
-    {
-        gImage = 0;
-        fprintf(stderr, "Can't open %s: %s\n", img->filename, err->message);
-        g_error_free(err);
-        return -1;
-    }
-    ReadCaption(img);
+    /* Don't read over a caption that's been edited or restored.
+     * A caption file is read in the background, while we decode.
+     */
+    if (!img->caption)
+        ReadCaption(img);
 
-    img->curWidth = gdk_pixbuf_get_width(gImage);
-    img->curHeight = gdk_pixbuf_get_height(gImage);
+    /* It may already have been decoded, and maybe scaled, if it's the
+     * next slide or it just arrived in --watch mode.
+     */
+    gImage = TakePrefetchedImage(img, &trueWidth, &trueHeight);
+    if (!gImage) {
+        gImage = gdk_pixbuf_new_from_file(img->filename, &err);
+        if (!gImage)
+        {
+            fprintf(stderr, "Can't open %s: %s\n", img->filename, err->message);
+            g_error_free(err);
+            return -1;
+        }
+        trueWidth = gdk_pixbuf_get_width(gImage);
+        trueHeight = gdk_pixbuf_get_height(gImage);
+    }
+    img->curWidth = LogicalPixels(gdk_pixbuf_get_width(gImage));
+    img->curHeight = LogicalPixels(gdk_pixbuf_get_height(gImage));
+    sPixelImg = img;
+    sPixelRot = 0;
+    ++gRenderStats.decodes;
 
     /* The first time an image is loaded, it should be rotated
      * to its appropriate EXIF rotation. Subsequently, though,
@@ -170,8 +264,8 @@ static int LoadImageFromFile(PhoImage* img)
      * but that doesn't make sense -- we need it not just the first
      * time, but also ever time the image is reloaded.
      */
-    img->trueWidth = img->curWidth;
-    img->trueHeight = img->curHeight;
+    img->trueWidth = trueWidth;
+    img->trueHeight = trueHeight;
 
     return 0;
 }
@@ -179,26 +273,36 @@ static int LoadImageFromFile(PhoImage* img)
 static int LoadImageAndRotate(PhoImage* img)
 {
     int e;
-    int rot = (img ? img->curRot : 0);
+    int rot;
     int firsttime = (img && (img->trueWidth == 0));
 
     if (!img) return -1;
 
-    img->trueWidth = img->trueHeight = img->curRot = 0;
+    CountNavigation();
+
+    /* The first time, take what its XMP sidecar says, if that's in */
+    if (firsttime)
+        LoadXmp(img);
+    rot = img->curRot;
+
+    img->trueWidth = img->trueHeight = 0;
 
     e = LoadImageFromFile(img);
     if (e) return e;
 
-    /* If it's not the first time we've loaded this image,
+    /* If it's the first time we've loaded this image,
      * default its rotation to the EXIF rotation if any.
      * Otherwise rotate to the saved img->curRot.
      */
-    if (firsttime && img->exifRot != 0)
-        ScaleAndRotate(gCurImage, img->exifRot);
-
+    if (firsttime && img->exifRot != 0 && !JournalHasRotation(img)
+        && !XmpHasRotation(img))
+        img->curRot = (img->exifRot + 360) % 360;
     else
-        ScaleAndRotate(gCurImage, rot);
+        img->curRot = (rot + 360) % 360;
 
+    if (img == gCurImage)
+        RequestRender(PHO_RENDER_SCALE | PHO_RENDER_ROTATION
+                      | PHO_RENDER_WINDOW);
     return 0;
 }
 
@@ -213,41 +317,27 @@ int ThisImage()
     return 0;
 }
 
-/* Go to the next image after gCurImage,
- * or the first image if gCurImage isn't set. If an image fails to load,
+/* Go to the next image after gCurImage (in the order they're shown,
+ * skipping any that don't pass the filter), or the first image if
+ * gCurImage isn't set. If an image fails to load,
  * delete it from the image list and move on to the next image.
  */
 int NextImage()
 {
+    int pos;
+
     if (gDebug)
         printf("\n================= NextImage ====================\n");
 
-    PhoImage* origCurImage = gCurImage;
-
     /* Loop, since images may fail to load
      * and may need to be deleted from the list
      */
-    while (1)
+    for (pos = NextPosition(CurrentPosition()); pos >= 0;
+         pos = NextPosition(pos))
     {
-        if (! gFirstImage) {
-            /* There's no list! How can we go to the next item? */
-            if (gDebug)
-                printf("NextImage: empty list!\n");
-            return -1;
-        }
-
-        if (! gCurImage) {
-            if (gDebug)
-                printf("NextImage: going to first image\n");
-            gCurImage = gFirstImage;
-        }
-        else if (gCurImage->next == gFirstImage) {  /* end of the list */
-            return -1;
-        }
-        else {
-            gCurImage = gCurImage->next;
-        }
+        int origIndex = gCurIndex;
 
+        SetCurrentPosition(pos);
         if (LoadImageAndRotate(gCurImage) == 0) {   /* Success! */
             ShowImage();
             return 0;
@@ -257,110 +347,102 @@ int NextImage()
         if (gDebug)
             printf("Skipping '%s' (didn't load)\n", gCurImage->filename);
         DeleteItem(gCurImage);
-        gCurImage = origCurImage;
+        SetCurrentImage(origIndex);
     }
+
+    /* End of the list, or there's no list at all */
+    if (gDebug && CountImages() == 0)
+        printf("NextImage: empty list!\n");
+    return -1;
 }
 
 int PrevImage()
 {
+    int pos;
+
     if (gDebug)
         printf("\n================= PrevImage ====================\n");
-    do {
-        if (gCurImage == 0) {  /* no image loaded yet, first call */
-            gCurImage = gFirstImage;
-            if (gCurImage->prev)
-                gCurImage = gCurImage->prev;
-        }
-        else {
-            if (gCurImage == gFirstImage)
-                return -1;  /* end of list */
-            gCurImage = gCurImage->prev;
-        }
-    } while (LoadImageAndRotate(gCurImage) != 0);
-    ShowImage();
-    return 0;
-}
 
-int CountImages()
-{
-    if (!gFirstImage)
-        return 0;
-    int numImages = 1;
-    PhoImage* img = gFirstImage;
-    while (img->next != gFirstImage) {
-        ++numImages;
-        img = img->next;
+    /* With no image loaded yet, the first call goes to the last image */
+    pos = (gCurIndex < 0 ? gNumImages : CurrentPosition());
+
+    while ((pos = PrevPosition(pos)) >= 0) {
+        SetCurrentPosition(pos);
+        if (LoadImageAndRotate(gCurImage) == 0) {
+            ShowImage();
+            return 0;
+        }
     }
-    return numImages;
+    return -1;  /* beginning of list */
 }
 
-/* Return a random integer in range [0, upper_bound) without modulo bias.
- * Uses rejection sampling for uniform distribution.
+/* Jump straight to the image at position pos (counting from 0),
+ * or the nearest image after it if that one has been removed
+ * or doesn't pass the filter, without loading anything in between.
  */
-static int random_uniform(int upper_bound)
+int GotoImage(int pos)
 {
-    int r;
-    int limit = RAND_MAX - (RAND_MAX % upper_bound);
-    
-    if (upper_bound <= 1)
-        return 0;
-    
-    do {
-        r = rand();
-    } while (r >= limit);
-    
-    return r % upper_bound;
-}
-
-void ShuffleArray(PhoImage** arr, int len)
-{
-    size_t i;
-    /* Use size_t for indices to prevent integer overflow with large arrays */
-    for (i = (size_t)len; i > 1; i--)
-    {
-        size_t j = random_uniform((int)i);
-        PhoImage* tmp = arr[j];
-        arr[j] = arr[i-1];
-        arr[i-1] = tmp;
-    }
-}
+    int i;
 
-/* Randomize the image list. Does not change gCurImage. */
-void ShuffleImages()
-{
     if (gDebug)
-        printf("Randomizing image order\n");
+        printf("\n================= GotoImage %d ====================\n",
+               pos);
+
+    if (pos < 0)
+        pos = 0;
+    if (pos >= gNumImages)
+        pos = gNumImages - 1;
+
+    i = NextPosition(pos - 1);
+    if (i < 0)
+        i = PrevPosition(pos);
+    if (i < 0)
+        return -1;
 
-    srand(time(NULL));
+    SetCurrentPosition(i);
+    return ThisImage();
+}
 
-    /* Now shuffle the list and replace it with the shuffled version. */
+/* Turn a position typed by the user into a position for GotoImage():
+ * "k" is the k'th image, counting from 1, and "p%" is p percent
+ * of the way through the list, counting only images that haven't
+ * been removed. Out-of-range positions are clamped to the first or
+ * last image. Returns -1 if spec isn't a position.
+ */
+int ParseImagePosition(const char* spec)
+{
+    char* end;
+    double num;
+    int count = CountImages();
+    int rank;
 
-    /* count total number of images */
-    int numImages = CountImages();
-    if (numImages < 2)
-        return;
+    if (!spec || count <= 0)
+        return -1;
 
-    /* make an array with pointers to each list element: */
-    PhoImage* imgarr[numImages];
-    int i;
-    PhoImage* curImg = gFirstImage;
-    for (i=0; i<numImages; ++i) {
-        imgarr[i] = curImg;
-        curImg = curImg->next;
+    num = strtod(spec, &end);
+    if (end == spec || !isfinite(num))
+        return -1;
+    while (*end == ' ')
+        ++end;
+
+    if (*end == '%') {
+        ++end;
+        if (num < 0) num = 0;
+        if (num > 100) num = 100;
+        rank = (int)(num / 100. * (count - 1) + .5);
     }
-
-    ShuffleArray(imgarr, numImages);
-
-    gFirstImage = curImg = imgarr[0];
-    for (i=0; i<numImages; ++i) {
-        PhoImage* lastImg = curImg;
-        curImg = imgarr[i];
-        lastImg->next = curImg;
-        curImg->prev = lastImg;
+    else {
+        if (num < 1) num = 1;
+        if (num > count) num = count;
+        rank = (int)num - 1;
     }
-    /* fill in the last image's next */
-    curImg->next = gFirstImage;
- }
+
+    while (*end == ' ')
+        ++end;
+    if (*end)
+        return -1;
+    return LivePosition(rank);
+}
 
 /* Limit new_width and new_height so that they're no bigger than
  * max_width and max_height. This doesn't actually scale, just
@@ -434,26 +516,97 @@ void ScaleToFit(int *width, int *height,
 #define SWAP(a, b) { int temp = a; a = b; b = temp; }
 /*#define SWAP(a, b)  {a ^= b; b ^= a; a ^= b;}*/
 
-/* Rotate the image according to the current scale mode, scaling as needed,
- * then redisplay.
- * 
- * This will read the image from disk if necessary,
- * and it will rotate the image at the appropriate time
- * (when the image is at its smallest).
+/* Ask for img to be scaled according to the current scale mode, and
+ * rotated by degrees more than its current rotation (curRot), then
+ * redisplayed. img->curRot changes right away; the pixels change on
+ * the next CommitRender().
  *
  * This is the routine that should be called by external callers:
  * callers should never need to call RotateImage.
- *
- * degrees is the increment from the current rotation (curRot).
  */
 int ScaleAndRotate(PhoImage* img, int degrees)
+{
+    int flags = PHO_RENDER_SCALE;
+
+    if (!img) return -1;  /* NULL image */
+
+    degrees = (degrees + 360) % 360;
+    if (degrees != 0) {
+        img->curRot = (img->curRot + degrees) % 360;
+        flags |= PHO_RENDER_ROTATION;
+    }
+    if (img == gCurImage) {
+        if (img != sPixelImg)
+            flags |= PHO_RENDER_SOURCE;
+        RequestRender(flags);
+    }
+    return 0;
+}
+
+/* Do whatever RequestRender() has asked for, for the current image.
+ * Returns 0, or -1 if the image couldn't be decoded or scaled.
+ */
+int CommitRender()
+{
+    PhoImage* img = gCurImage;
+    int dirty = sRenderDirty;
+    int ret = 0;
+
+    if (sRenderIdle) {
+        g_source_remove(sRenderIdle);
+        sRenderIdle = 0;
+    }
+    sRenderDirty = 0;
+    if (!img || !dirty)
+        return 0;
+    ++gRenderStats.commits;
+
+    if (img != sPixelImg || img->trueWidth == 0 || img->trueHeight == 0) {
+        if (gDebug) printf("Loading from CommitRender!\n");
+        if (LoadImageFromFile(img) != 0)
+            return -1;
+        dirty |= PHO_RENDER_WINDOW;
+    }
+
+    if (dirty & (PHO_RENDER_SOURCE | PHO_RENDER_SCALE | PHO_RENDER_ROTATION)) {
+        int want = img->curRot;
+        int oldw = img->curWidth, oldh = img->curHeight;
+
+        /* DoScaleAndRotate works from the rotation the pixels have */
+        img->curRot = sPixelRot;
+        ret = DoScaleAndRotate(img, want - sPixelRot);
+        sPixelRot = img->curRot;
+        img->curRot = want;
+
+        /* Its rotation or orientation may have changed what matches */
+        FilterImageChanged(img);
+
+        if (img->curWidth != oldw || img->curHeight != oldh
+            || (dirty & PHO_RENDER_ROTATION))
+            dirty |= PHO_RENDER_WINDOW;
+    }
+
+    /* Now we may need to make changes in the window size or position. */
+    if (dirty & PHO_RENDER_WINDOW)
+        PrepareWindow();
+    return ret;
+}
+
+/* Scale gImage for the current scale mode and rotate it by degrees,
+ * which is relative to the rotation it has (curRot), reloading it
+ * from disk if it needs to get bigger than the pixels we have.
+ * It rotates the image at the appropriate time
+ * (when the image is at its smallest).
+ */
+static int DoScaleAndRotate(PhoImage* img, int degrees)
 {
     if (!img) return -1;  /* NULL image */
     
-#define true_width img->trueWidth
-#define true_height img->trueHeight
+#define true_width LogicalPixels(img->trueWidth)
+#define true_height LogicalPixels(img->trueHeight)
     int new_width;
     int new_height;
+    int pix_width, pix_height;
 
     if (gDebug)
         printf("ScaleAndRotate(%d (cur = %d))\n", degrees, img->curRot);
@@ -461,12 +614,6 @@ int ScaleAndRotate(PhoImage* img, int degrees)
     /* degrees should be between 0 and 360 */
     degrees = (degrees + 360) % 360;
 
-    /* First, load the image if we haven't already, to get true w/h */
-    if (true_width == 0 || true_height == 0) {
-        if (gDebug) printf("Loading, first time, from ScaleAndRotate!\n");
-        LoadImageFromFile(img);
-    }
-
     /*
      * Calculate new_width and new_height, the size to which the image
      * should be scaled before or after rotation,
@@ -605,8 +752,10 @@ int ScaleAndRotate(PhoImage* img, int degrees)
      */
 
     /* First figure out if we're getting bigger and hence need to reload. */
-    if ((new_width > img->curWidth || new_height > img->curHeight)
-        && (img->curWidth < true_width && img->curHeight < true_height)) {
+    if ((new_width * gScaleFactor > gdk_pixbuf_get_width(gImage)
+         || new_height * gScaleFactor > gdk_pixbuf_get_height(gImage))
+        && (gdk_pixbuf_get_width(gImage) < img->trueWidth
+            && gdk_pixbuf_get_height(gImage) < img->trueHeight)) {
         if (gDebug)
             printf("Getting bigger, from %dx%d to %dx%d -- need to reload\n",
                    img->curWidth, img->curHeight, new_width, new_height);
@@ -659,12 +808,26 @@ int ScaleAndRotate(PhoImage* img, int degrees)
     }
 #endif
 
+    /* new_width and new_height are logical; the pixels are rendered
+     * once at device resolution, except that full size is exactly
+     * the image's own size.
+     */
+    if (new_width == true_width && new_height == true_height) {
+        pix_width = img->trueWidth;
+        pix_height = img->trueHeight;
+    }
+    else {
+        pix_width = new_width * gScaleFactor;
+        pix_height = new_height * gScaleFactor;
+    }
+
     /* Do the scaling (thought we'd never get there!) */
-    if (new_width != img->curWidth || new_height != img->curHeight)
+    if (pix_width != gdk_pixbuf_get_width(gImage)
+        || pix_height != gdk_pixbuf_get_height(gImage))
     {
         GdkPixbuf* newimage = gdk_pixbuf_scale_simple(gImage,
-                                                      new_width,
-                                                      new_height,
+                                                      pix_width,
+                                                      pix_height,
                                                       GDK_INTERP_BILINEAR);
         /* If that's too slow use GDK_INTERP_NEAREST */
 
@@ -692,27 +855,23 @@ int ScaleAndRotate(PhoImage* img, int degrees)
         if (gImage)
             g_object_unref(gImage);
         gImage = newimage;
-
-        img->curWidth = gdk_pixbuf_get_width(gImage);
-        img->curHeight = gdk_pixbuf_get_height(gImage);
+        ++gRenderStats.resamples;
     }
+    img->curWidth = new_width;
+    img->curHeight = new_height;
 
     /* If we didn't rotate before, do it now. */
     if (degrees != 0)
         RotateImage(img, degrees);
 
-    /* We've finished making our changes. Now we may need to make
-     * changes in the window size or position.
-     */
-    PrepareWindow();
     return 0;
 }
 
 PhoImage* NewPhoImage(char* fnam)
 {
-    PhoImage* newimg = calloc(1, sizeof (PhoImage));
+    PhoImage* newimg = AllocPhoImage();
     if (!newimg) return 0;
-    newimg->filename = fnam;  /* no copy, we don't own the memory */
+    newimg->filename = PoolString(fnam);
 
     return newimg;
 }
@@ -722,16 +881,11 @@ void ReallyDelete(PhoImage* delImg)
     /* Make sure the keywords dialog doesn't save a pointer to this image */
     NoCurrentKeywords();
 
-    if (unlink(delImg->filename) < 0)
-    {
-        printf("OOPS!  Can't delete %s\n", delImg->filename);
-        return;
-    }
-
-    DeleteItem(delImg);
+    /* The file itself goes later, in the background */
+    QueueDelete(delImg);
 
     /* If we just deleted the only image, all we can do is quit */
-    if (!gFirstImage)
+    if (CountImages() == 0)
         EndSession();
 
     ThisImage();
@@ -759,6 +913,7 @@ static int RotateImage(PhoImage* img, int degrees)
     int x, y;
     int oldrowstride, newrowstride, nchannels, bitsper, alpha;
     int newWidth, newHeight, newTrueWidth, newTrueHeight;
+    int oldPixWidth, oldPixHeight, newPixWidth, newPixHeight;
     GdkPixbuf* newImage;
 
     if (!gImage) return 1;     /* sanity check */
@@ -792,6 +947,20 @@ static int RotateImage(PhoImage* img, int degrees)
         newTrueHeight = img->trueHeight;
     }
 
+    /* The pixels are at device resolution, so may not be curWidth
+     * by curHeight: go by the pixbuf's own size.
+     */
+    oldPixWidth = gdk_pixbuf_get_width(gImage);
+    oldPixHeight = gdk_pixbuf_get_height(gImage);
+    if (degrees == PHO_ROTATE_90 || degrees == PHO_ROTATE_270) {
+        newPixWidth = oldPixHeight;
+        newPixHeight = oldPixWidth;
+    }
+    else {
+        newPixWidth = oldPixWidth;
+        newPixHeight = oldPixHeight;
+    }
+
     oldrowstride = gdk_pixbuf_get_rowstride(gImage);
     /* Sometimes rowstride is slightly different from width*nchannels:
      * gdk_pixbuf optimizes by aligning to 32-bit boundaries.
@@ -806,38 +975,38 @@ static int RotateImage(PhoImage* img, int degrees)
     oldpixels = gdk_pixbuf_get_pixels(gImage);
 
     newImage = gdk_pixbuf_new(GDK_COLORSPACE_RGB, alpha, bitsper,
-                              newWidth, newHeight);
+                              newPixWidth, newPixHeight);
     if (!newImage) return 1;
     newpixels = gdk_pixbuf_get_pixels(newImage);
     newrowstride = gdk_pixbuf_get_rowstride(newImage);
 
     /* Validate dimensions to prevent underflow in rotation calculations */
-    if (img->curWidth <= 0 || img->curHeight <= 0) {
+    if (oldPixWidth <= 0 || oldPixHeight <= 0) {
         fprintf(stderr, "Invalid image dimensions: %dx%d\n", 
-                img->curWidth, img->curHeight);
+                oldPixWidth, oldPixHeight);
         g_object_unref(newImage);
         return 1;
     }
 
-    for (x = 0; x < img->curWidth; ++x)
+    for (x = 0; x < oldPixWidth; ++x)
     {
-        for (y = 0; y < img->curHeight; ++y)
+        for (y = 0; y < oldPixHeight; ++y)
         {
             int newx, newy;
             int i;
             switch (degrees)
             {
               case 90:
-                newx = img->curHeight - y - 1;
+                newx = oldPixHeight - y - 1;
                 newy = x;
                 break;
               case 270:
                 newx = y;
-                newy = img->curWidth - x - 1;
+                newy = oldPixWidth - x - 1;
                 break;
               case 180:
-                newx = img->curWidth - x - 1;
-                newy = img->curHeight - y - 1;
+                newx = oldPixWidth - x - 1;
+                newy = oldPixHeight - y - 1;
                 break;
               default:
                 printf("Illegal rotation value!\n");
@@ -858,6 +1027,7 @@ static int RotateImage(PhoImage* img, int degrees)
 
     g_object_unref(gImage);
     gImage = newImage;
+    ++gRenderStats.rotations;
 
     return 0;
 }
@@ -865,18 +1035,28 @@ static int RotateImage(PhoImage* img, int degrees)
 void Usage()
 {
     printf("pho version %s.  Copyright 2002-2009 Akkana Peck akkana@shallowsky.com.\n", VERSION);
-    printf("Usage: pho [-dhnp] image [image ...]\n");
+    printf("Usage: pho [-dhnp] [-@ listfile] image|dir [image|dir ...]\n");
     printf("\t-p:  Presentation mode (full screen, centered)\n");
     printf("\t-p[resolution]: Projector mode:\n\tlike presentation mode but in upper left corner\n");
     printf("\t-P:  No presentation mode (separate window) -- default\n");
     printf("\t-k:  Keywords mode (show a Keywords dialog for each image)\n");
     printf("\t-R:  Randomize order in which images will be shown\n");
+    printf("\t--watch dir: Show images in dir, and new ones as they arrive\n");
+    printf("\t--follow: With --watch, jump to each new image as it arrives\n");
+    printf("\t--journal file: Record notes, rotations and captions in file as they're made,\n\tand restore them from it when starting\n");
+    printf("\t--notes-format json|nul|tsv: At exit, print a record for each image\n\tinstead of lists of filenames\n");
+    printf("\t--transition none|fade|slide: How slideshows in presentation mode\n\tchange images\n");
+    printf("\t--xmp: Read and write keywords, captions and rotation in XMP sidecars\n\t(image.jpg.xmp)\n");
+    printf("\t--session file: Save the image list, position and notes in file at exit,\n\tand carry on from there if file already exists\n");
+    printf("\t--trash dir: Move deleted images to dir instead of deleting them\n");
+    printf("\t--seed N: Random order picked by N, the same every time (implies -R)\n");
     printf("\t-mN: Use monitor number N.\n");
     printf("\t-n:  Replace each image window with a new window (helpful for some window managers)\n");
     printf("\t-s:  Slideshow mode with default %d second delay\n", DEFAULT_SLIDESHOW_DELAY / 1000);
     printf("\t-sN: Slideshow mode, where N is the timeout in seconds\n");
     printf("\t-r:  Repeat: loop back to the first image after showing the last\n");
     printf("\t-cpattern: Caption/Comment file pattern, format string for reworking filename\n");
+    printf("\t-@ listfile: Read image names from listfile (- for stdin),\n\tone per line or NUL-separated (find -print0)\n");
     printf("\t--:  Assume no more flags will follow\n");
     printf("\t-d:  Debug messages\n");
     printf("\t-h:  Help: Print this summary\n");
@@ -892,11 +1072,15 @@ void VerboseHelp()
     printf("<space>, <Page Down>\n\tNext image (or cancel slideshow mode)\n");
     printf("<backspace>, <Page Up>\n\tPrevious image\n");
     printf("<home>\tFirst image\n");
+    printf("j\tJump to an image by number (e.g. 120) or percentage (e.g. 50%%)\n");
+    printf("v\tShow only images matching a filter, e.g. \"3 !rotated, portrait\"\n");
+    printf("\t(empty shows all images again)\n");
     printf("f\tToggle full-size mode (even if bigger than screen)\n");
     printf("F\tToggle fullscreen mode (scale even small images up to fullscreen)\n");
     printf("k\tTurn on keywords mode: show the keywords dialog\n");
     printf("p\tToggle presentation mode (take up the whole screen, centering the image)\n");
     printf("d\tDelete current image (from disk, after confirming with another d)\n");
+    printf("u\tUndelete: bring back the last image deleted, if its file hasn't gone yet\n");
     printf("0-9\tRemember image in note list 0 through 9 (to be printed at exit)\n");
     printf("\t(In keywords dialog, alt + 0-9 adds 10, e.g. alt-4 triggers flag 14.\n");
     printf("t, r, <Right>\n\tRotate right 90 degrees\n");
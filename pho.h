@@ -10,32 +10,61 @@
 /* GTK3 single header include - gdk is now part of gtk */
 #include <gtk/gtk.h>
 
-/* Images are kept in a doubly linked list.
- * gFirstImage is the beginning;
- * gFirstImage->prev is the last item,
- * lastImg->next is gFirstImage.
+/* Images are kept in a growable array, gImageList, in the order
+ * they'll be shown. An image's index in the array is its position
+ * in the list, and never changes once assigned: removing an image
+ * leaves an empty slot rather than renumbering everything after it.
  */
+/* Notes (keywords) are numbered from 0 to NUM_NOTES-1, and each image
+ * has a bitset of the ones it's tagged with. Use HasNote() and SetNote()
+ * rather than touching the bits, so the per-note index stays right.
+ */
+#define NUM_NOTES 256
+#define NOTE_WORD_BITS 64
+#define NOTE_WORDS (NUM_NOTES / NOTE_WORD_BITS)
+
+typedef struct {
+    guint64 words[NOTE_WORDS];
+} NoteSet;
+
 typedef struct PhoImage_s {
     char* filename;
 
     int trueWidth, trueHeight;  /* may be swapped if rot = 90 or 270 */
     int curWidth, curHeight;
-    int curRot;       /* current rotation of the current image bits */
-    int exifRot;      /* exif-specified rotation */
-    unsigned long noteFlags;
-    unsigned int deleted;
-    struct PhoImage_s* prev;
-    struct PhoImage_s* next;
-    char* comment;
+    short curRot;     /* current rotation of the current image bits */
+    short exifRot;    /* exif-specified rotation */
+    unsigned int deleted : 1;       /* file will be deleted soon */
+    unsigned int captionDirty : 1;  /* caption changed since it was saved */
+    unsigned int xmpDirty : 1;      /* needs its XMP sidecar rewritten */
+    NoteSet notes;
+    char* comment;    /* comment and caption are pooled: see PoolString() */
     char* caption;
 } PhoImage;
 
 /* Captions can be specified in a separate file */
 extern char *gCapFileFormat; /* Format for opening caption/comment file */
 extern void ReadCaption(PhoImage* img);
-
-/* Number of bits in unsigned long noteFlags */
-#define NUM_NOTES ((sizeof (unsigned long) * 8) - 1)
+extern char* CapFileName(PhoImage* img);
+extern int GlobalCaptionFile();
+extern const char* IndexedCaption(const char* filename);
+
+/* Caption files are read, and changed captions written, in the background */
+extern void LoadCaptionFile(PhoImage* img);
+extern int CaptionsPending();
+extern void MarkCaptionDirty(PhoImage* img);
+extern void WriteCaptions();
+extern void FinishCaptionWrites();
+extern int WriteFileAtomically(const char* path, const char* text);
+
+/* --xmp: keep notes, captions and rotation in XMP sidecars too */
+extern int gUseXmp;
+extern void LoadXmp(PhoImage* img);
+extern int XmpReadsPending();
+extern int XmpHasRotation(PhoImage* img);
+extern void MarkXmpDirty(PhoImage* img);
+extern void LeavingImage(PhoImage* img);
+extern void FinishXmpWrites();
 
 extern PhoImage* NewPhoImage(char* filename);
 
@@ -43,13 +72,20 @@ extern PhoImage* NewPhoImage(char* filename);
  * Globals
  */
 
-extern PhoImage* gFirstImage;
+/* The image list: gNumImages slots, some of which may be empty (0)
+ * if their images were removed. gCurImage is gImageList[gCurIndex],
+ * or 0 if gCurIndex is -1; change both with SetCurrentImage().
+ */
+extern PhoImage** gImageList;
+extern int gNumImages;
+extern int gCurIndex;
 extern PhoImage* gCurImage;
 
 /* Monitor resolution */
 extern int gMonitorWidth, gMonitorHeight;
 extern int gPhysMonitorWidth, gPhysMonitorHeight;
 extern int gPresentationWidth, gPresentationHeight;
+extern int gScaleFactor;    /* device pixels per logical pixel */
 
 /* We only have one image at a time, so make it global. */
 extern GdkPixbuf* gImage;
@@ -124,15 +160,39 @@ extern double FracOfScreenSize();
 /* ************** List maintenance functions ************** */
 extern void DeleteItem(PhoImage* item);
 extern void AppendItem(PhoImage* item);
+extern void RestoreItem(PhoImage* item, int index);
 extern void ClearImageList();
-extern void ShuffleImages();
+extern PhoImage* AllocPhoImage();
+extern char* PoolString(const char* str);
+extern void ShuffleImages(unsigned int seed);
+extern int PositionToIndex(int pos);
+extern int IndexToPosition(int index);
+extern PhoImage* ImageAtPosition(int pos);
+extern int CurrentPosition();
+extern void SetCurrentPosition(int pos);
+extern PhoImage* ImageAt(int index);
+extern int IndexOfImage(PhoImage* img);
+extern void SetCurrentImage(int index);
+
+/* ************** Filtered views of the list ************** */
+extern int SetImageFilter(const char* expr);
+extern const char* ImageFilter();
+extern int FilterCount();
+extern int FilterRank(int pos);
+extern void RebuildFilterView();
+extern void FilterImageChanged(PhoImage* img);
+extern void FilterImageAdded(int index);
+extern void FilterImageRemoved(int index);
+extern int NextPosition(int pos);
+extern int PrevPosition(int pos);
 
 /* ************** Scaling Functions ************** */
 extern void ScaleToFit(int *width, int *height,
                        int max_width, int max_height,
                        int scaleMode, double scaleRatio);
-extern void ShuffleArray(PhoImage** arr, int len);
 extern int CountImages(void);
+extern int LiveRank(int pos);
+extern int LivePosition(int rank);
 
 /* ************** Misc. functions ************** */
 /* Some window managers don't deal well with windows that resize,
@@ -152,6 +212,15 @@ extern int gDelayMillis;
 /* Loop back to the first image after showing the last one */
 extern int gRepeat;
 
+/* How a slideshow moves from one image to the next (--transition) */
+#define PHO_TRANSITION_NONE  0
+#define PHO_TRANSITION_FADE  1
+#define PHO_TRANSITION_SLIDE 2
+extern int gTransition;
+extern int SetTransition(const char* name);
+extern void TakeTransitionSnapshot();
+extern void StartTransition();
+
 /* Get the keyword string associated with a note number */
 extern char* KeywordString(int notenum);
 
@@ -164,10 +233,68 @@ extern void PrepareWindow();
 extern void DrawImage(cairo_t *cr);
 extern int ScaleAndRotate(PhoImage* img, int degrees);
 
+/* What needs redoing before the current image is drawn again */
+#define PHO_RENDER_SOURCE   0x1     /* decode it from the file */
+#define PHO_RENDER_SCALE    0x2     /* resample for the scale mode */
+#define PHO_RENDER_ROTATION 0x4     /* rotate the pixels to curRot */
+#define PHO_RENDER_WINDOW   0x8     /* size and place the window */
+extern void RequestRender(int flags);
+extern int CommitRender();
+
+/* How much work rendering has done, to check it's not done twice.
+ * Frames of a --transition aren't counted as paints.
+ */
+typedef struct {
+    unsigned long decodes, resamples, rotations, commits, paints;
+} PhoRenderStats;
+extern PhoRenderStats gRenderStats;
+
 extern PhoImage* AddImage(char* filename);
 extern void DeleteImage(PhoImage* img);
+
+/* --journal: record changes as they're made, and restore them later */
+extern void OpenJournal(const char* filename);
+extern void CloseJournal();
+extern void JournalRestore(PhoImage* img);
+extern int JournalHasRotation(PhoImage* img);
+extern void JournalNote(PhoImage* img, int note, int on);
+extern void JournalRotation(PhoImage* img);
+extern void JournalCaption(PhoImage* img);
+extern void JournalComment(PhoImage* img);
+
+/* --session: save the list and position at exit, and resume from it */
+extern char* gSessionFile;
+extern int SaveSession(const char* filename, int curpos);
+extern int ResumeSession(const char* filename);
+
+/* Deleted files go away in the background, after a chance to undo */
+extern char* gTrashDir;
+extern void QueueDelete(PhoImage* img);
+extern int UndoDelete();
+extern void CommitDeletes();
+extern void ForgetDeletes();
+extern void FinishDeletes();
 extern void ClearImageList();
 extern void ChangeWorkingFileSet();
+extern void PromptGotoImage();
+extern void PromptImageFilter();
+
+/* Adding the images under a directory happens in the background */
+extern void AddDirectory(const char* dirname);
+extern int WaitForDirScans(int all);
+extern int DirScansPending();
+extern void CancelDirScans();
+extern int LooksLikeImage(const unsigned char* buf, size_t len);
+extern void InitImageTypes();
+extern int IsImageFile(int dirfd, const char* name);
+
+/* --watch mode: add images as they arrive in a directory */
+extern int gWatchFollow;
+extern void WatchDirectory(const char* dirname);
+extern int WaitForWatchedImage();
+extern GdkPixbuf* TakePrefetchedImage(PhoImage* img, int* trueWidth,
+                                      int* trueHeight);
+extern void PrefetchImage(int index);
 extern void ToggleKeywordsMode();
 
 extern void Usage();
@@ -177,11 +304,28 @@ extern void EndSession();
 extern int NextImage();
 extern int PrevImage();
 extern int ThisImage();
+extern int GotoImage(int index);
+extern int ParseImagePosition(const char* spec);
 extern int ShowImage();
 
 extern void ToggleNoteFlag(PhoImage* img, int note);
+extern int HasNote(PhoImage* img, int note);
+extern void SetNote(PhoImage* img, int note, int on);
+extern void IndexNotes(PhoImage* img, int index);
+extern int NoteCount(int note);
+extern const int* NoteImages(int note, int* count);
+extern void ClearNoteIndex();
 extern void InitNotes();
 extern void PrintNotes();
 
+/* What PrintNotes() prints: lists of filenames, or a record per image */
+#define PHO_NOTES_TEXT 0
+#define PHO_NOTES_JSON 1
+#define PHO_NOTES_NUL  2
+#define PHO_NOTES_TSV  3
+extern int gNotesFormat;
+extern int SetNotesFormat(const char* name);
+extern void FormatNoteRecord(GString* out, PhoImage* img, int format);
+
 /* event handler. Ugh, this introduces gtk stuff */
 extern gint HandleGlobalKeys();
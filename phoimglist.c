@@ -6,90 +6,416 @@
  * You are free to use or modify this code under the Gnu Public License.
  */
 
-/* A PhoImage is a doubly-linked list, with ->next and ->prev.
- * The global gFirstImage marks the head of the list;
- * the list is circular, so the last item has next = gFirstImage.
+/* The image list is a growable array of PhoImage pointers, gImageList,
+ * with gNumImages slots in use. Appending is amortized O(1), and so is
+ * getting from a position to its image or counting the images.
  *
- * gCurImage points to the current list item.
+ * Positions are stable: removing an image frees it and leaves its slot
+ * empty (0) instead of moving every later image down, so anything
+ * that remembers a position (or a PhoImage pointer) stays valid.
+ * LiveRank() and LivePosition() convert between positions and the
+ * 1-of-N numbering the user sees, which skips removed images.
  *
- * List items are freed with FreePhoImage()
+ * gCurIndex is the position of the current image, and gCurImage
+ * the image itself; use SetCurrentImage() to change them.
+ *
+ * PhoImage records aren't malloced one at a time: they're carved out of
+ * slabs of PHO_SLAB_SIZE records, and their strings (filenames,
+ * comments and captions) are interned in a string pool, so the many
+ * images that share a comment or caption share one copy of it.
+ * Nothing is freed until ClearImageList(), which just rewinds the
+ * slabs for reuse and empties the pool, no matter how many images
+ * there were.
+ *
+ * The order images are shown in can differ from their list order:
+ * ShuffleImages() doesn't move anything, it picks a seeded permutation
+ * that maps each position in the slideshow to an index in gImageList.
+ * Navigation works in positions; use PositionToIndex() and
+ * IndexToPosition() to go between the two.
  */
 
 #include "pho.h"
 #include <stdlib.h>
+#include <string.h>
+
+PhoImage** gImageList = 0;
+int gNumImages = 0;
+int gCurIndex = -1;
+PhoImage* gCurImage = 0;
+
+/* How many slots are allocated in gImageList */
+static int sListSize = 0;
+
+/* How many slots are empty because their image was removed */
+static int sNumRemoved = 0;
+
+/* The removed slots again, counted by position in a Fenwick tree so
+ * LiveRank() and LivePosition() don't have to walk the list:
+ * sRemovedTree[i] (1-based, sListSize+1 entries) is how many of the
+ * positions [i - (i & -i), i) have had their image removed.
+ */
+static int* sRemovedTree = 0;
+
+/* Number of PhoImage records in each slab */
+#define PHO_SLAB_SIZE 4096
+
+/* Slabs allocated so far (kept across ClearImageList() for reuse),
+ * how many of them are in use, and how many records are used in the last.
+ */
+static PhoImage** sSlabs = 0;
+static int sNumSlabs = 0;
+static int sSlabsUsed = 0;
+static int sSlabFill = PHO_SLAB_SIZE;
+
+/* Filenames, comments and captions */
+static GStringChunk* sStringPool = 0;
+
+/* The shuffle is a small Feistel network over the smallest power of 4
+ * that can hold sShuffleCount positions; positions that land outside
+ * [0, sShuffleCount) get permuted again ("cycle walking") until they
+ * land inside. Positions from sShuffleCount on (images added after
+ * shuffling) aren't shuffled. sShuffleCount is 0 when not shuffled.
+ */
+#define SHUFFLE_ROUNDS 4
+static int sShuffleCount = 0;
+static int sShuffleHalfBits = 0;
+static guint32 sShuffleKeys[SHUFFLE_ROUNDS];
+
+/* A zeroed PhoImage record from the current slab. */
+PhoImage* AllocPhoImage()
+{
+    PhoImage* img;
+
+    if (sSlabFill >= PHO_SLAB_SIZE) {
+        if (sSlabsUsed >= sNumSlabs) {
+            PhoImage** newslabs = realloc(sSlabs,
+                                          (sNumSlabs+1) * sizeof (PhoImage*));
+            PhoImage* slab = malloc(PHO_SLAB_SIZE * sizeof (PhoImage));
+            if (!newslabs || !slab) {
+                free(slab);
+                return 0;
+            }
+            sSlabs = newslabs;
+            sSlabs[sNumSlabs++] = slab;
+        }
+        ++sSlabsUsed;
+        sSlabFill = 0;
+    }
+
+    img = sSlabs[sSlabsUsed-1] + sSlabFill++;
+    memset(img, 0, sizeof *img);
+    return img;
+}
 
-/* This routine exists to keep track of any allocated memory
- * existing in the PhoImage structure.
+/* The pooled copy of str, shared with any other string that's equal
+ * to it, so it must not be changed. It lasts until ClearImageList().
  */
-static void FreePhoImage(PhoImage* img)
+char* PoolString(const char* str)
 {
-    if (img->comment) free(img->comment);
-    free(img);
+    if (!str)
+        return 0;
+    if (!sStringPool)
+        sStringPool = g_string_chunk_new(64 * 1024);
+    return g_string_chunk_insert_const(sStringPool, str);
 }
 
 static void printImageList()
 {
-    if (! gFirstImage) {
+    int i;
+
+    if (CountImages() == 0) {
         printf("  No images\n");
         return;
     }
-    PhoImage* im = gFirstImage;
-    PhoImage* lastIm = gFirstImage->prev;
-    while (im) {
-        if (im == gCurImage)
-            printf("> %s\n", im->filename);
+    for (i = 0; i < gNumImages; ++i) {
+        PhoImage* img = ImageAtPosition(i);
+        if (!img)
+            continue;
+        if (img == gCurImage)
+            printf("> %s\n", img->filename);
         else
-            printf("  %s\n", im->filename);
-        if (im == lastIm)
-            break;
-        im = im->next;
+            printf("  %s\n", img->filename);
     }
     printf("\n");
 }
 
+/* The image at a given position, or 0 if the position is out of range
+ * or its image has been removed.
+ */
+PhoImage* ImageAt(int index)
+{
+    if (index < 0 || index >= gNumImages)
+        return 0;
+    return gImageList[index];
+}
+
+/* Make the image at index the current image; -1 means no current image. */
+void SetCurrentImage(int index)
+{
+    PhoImage* old = gCurImage;
+
+    if (index < 0 || index >= gNumImages)
+        index = -1;
+    gCurIndex = index;
+    gCurImage = ImageAt(index);
+    if (old && old != gCurImage)
+        LeavingImage(old);
+}
+
+static guint32 ShuffleMix(guint32 x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+static guint32 FeistelForward(guint32 x)
+{
+    guint32 mask = (1u << sShuffleHalfBits) - 1;
+    guint32 left = x >> sShuffleHalfBits, right = x & mask;
+    int i;
+
+    for (i = 0; i < SHUFFLE_ROUNDS; ++i) {
+        guint32 newright = left ^ (ShuffleMix(right ^ sShuffleKeys[i]) & mask);
+        left = right;
+        right = newright;
+    }
+    return (left << sShuffleHalfBits) | right;
+}
+
+static guint32 FeistelBackward(guint32 x)
+{
+    guint32 mask = (1u << sShuffleHalfBits) - 1;
+    guint32 left = x >> sShuffleHalfBits, right = x & mask;
+    int i;
+
+    for (i = SHUFFLE_ROUNDS - 1; i >= 0; --i) {
+        guint32 newleft = right ^ (ShuffleMix(left ^ sShuffleKeys[i]) & mask);
+        right = left;
+        left = newleft;
+    }
+    return (left << sShuffleHalfBits) | right;
+}
+
+/* How many images shown before position pos have been removed */
+static int RemovedBefore(int pos)
+{
+    int n = 0;
+
+    for (; pos > 0; pos -= pos & -pos)
+        n += sRemovedTree[pos];
+    return n;
+}
+
+/* Count the slot at position pos as removed (delta 1) or back (-1) */
+static void CountRemoved(int pos, int delta)
+{
+    for (++pos; pos <= sListSize; pos += pos & -pos)
+        sRemovedTree[pos] += delta;
+}
+
+/* Count the removed slots from scratch, in O(n), after positions move
+ * or the list grows.
+ */
+static void RebuildRemovedTree()
+{
+    int i, parent;
+
+    if (!sRemovedTree)
+        return;
+    memset(sRemovedTree, 0, (sListSize + 1) * sizeof (int));
+    if (sNumRemoved == 0)
+        return;
+    for (i = 0; i < gNumImages; ++i)
+        if (!gImageList[i])
+            sRemovedTree[IndexToPosition(i) + 1] = 1;
+    for (i = 1; i <= sListSize; ++i) {
+        parent = i + (i & -i);
+        if (parent <= sListSize)
+            sRemovedTree[parent] += sRemovedTree[i];
+    }
+}
+
+/* Which image (index into gImageList) is shown at a given position */
+int PositionToIndex(int pos)
+{
+    guint32 x = pos;
+
+    if (pos < 0 || pos >= sShuffleCount)
+        return pos;
+    do
+        x = FeistelForward(x);
+    while (x >= (guint32)sShuffleCount);
+    return x;
+}
+
+/* At which position an index into gImageList is shown */
+int IndexToPosition(int index)
+{
+    guint32 x = index;
+
+    if (index < 0 || index >= sShuffleCount)
+        return index;
+    do
+        x = FeistelBackward(x);
+    while (x >= (guint32)sShuffleCount);
+    return x;
+}
+
+PhoImage* ImageAtPosition(int pos)
+{
+    if (pos < 0 || pos >= gNumImages)
+        return 0;
+    return ImageAt(PositionToIndex(pos));
+}
+
+/* Position of the current image, or -1 if there isn't one */
+int CurrentPosition()
+{
+    return IndexToPosition(gCurIndex);
+}
+
+void SetCurrentPosition(int pos)
+{
+    if (pos < 0 || pos >= gNumImages)
+        SetCurrentImage(-1);
+    else
+        SetCurrentImage(PositionToIndex(pos));
+}
+
+/* Show the images now in the list in an order picked by seed.
+ * Nothing is moved, so this takes the same time for any list size,
+ * and the same seed always gives the same order for the same list.
+ */
+void ShuffleImages(unsigned int seed)
+{
+    guint32 k = seed;
+    int i;
+
+    if (gDebug)
+        printf("Randomizing image order, seed %u\n", seed);
+
+    sShuffleCount = (gNumImages > 1 ? gNumImages : 0);
+    for (sShuffleHalfBits = 1;
+         sShuffleHalfBits < 16
+             && (1u << (2 * sShuffleHalfBits)) < (guint32)sShuffleCount;
+         ++sShuffleHalfBits)
+        ;
+    for (i = 0; i < SHUFFLE_ROUNDS; ++i) {
+        k += 0x9e3779b9;
+        sShuffleKeys[i] = ShuffleMix(k);
+    }
+
+    /* Positions have moved, so the removed slots and a filtered view
+     * need counting again.
+     */
+    RebuildRemovedTree();
+    RebuildFilterView();
+}
+
+/* Number of images in the list, not counting removed ones. */
+int CountImages()
+{
+    return gNumImages - sNumRemoved;
+}
+
+/* How many images that haven't been removed are shown before
+ * position pos. O(log n).
+ */
+int LiveRank(int pos)
+{
+    if (sNumRemoved == 0 || pos <= 0)
+        return pos;
+    if (pos > gNumImages)
+        pos = gNumImages;
+    return pos - RemovedBefore(pos);
+}
+
+/* The position of the image that has rank images that haven't been
+ * removed before it, or -1 if there's no such image. O(log n).
+ */
+int LivePosition(int rank)
+{
+    int pos = 0, step, live;
+
+    if (rank < 0 || rank >= CountImages())
+        return -1;
+    if (sNumRemoved == 0)
+        return rank;
+
+    /* Find the longest run of positions from 0 holding no more than
+     * rank live images; the image we want is the one right after it.
+     */
+    for (step = 1; step * 2 <= sListSize; step *= 2)
+        ;
+    for (; step > 0; step /= 2) {
+        if (pos + step > sListSize)
+            continue;
+        live = step - sRemovedTree[pos + step];
+        if (live <= rank) {
+            pos += step;
+            rank -= live;
+        }
+    }
+    return pos;
+}
+
+/* Find the position of an image, preferring the cheap answer. */
+int IndexOfImage(PhoImage* img)
+{
+    int i;
+
+    if (img == gCurImage)
+        return gCurIndex;
+    if (gNumImages > 0 && gImageList[gNumImages-1] == img)
+        return gNumImages - 1;      /* just appended */
+    for (i = 0; i < gNumImages; ++i)
+        if (gImageList[i] == img)
+            return i;
+    return -1;
+}
+
 /* Delete an image from the image list (not from disk).
  * Will use gCurImage if item == 0.
- * Update gCurImage if needed.
+ * If it's the current image, the next image (or the previous one,
+ * if it was the last) that passes the filter becomes current.
  */
 void DeleteItem(PhoImage* item)
 {
+    int index, i;
+
+    if (!item)
+        item = gCurImage;
+    if (!item)
+        return;
+
     if (gDebug) {
         printf("Removing image %s from image list\n", item->filename);
         printf("Image list before removal:\n");
         printImageList();
     }
 
-    if (!item)
-        item = gCurImage;
-
-    /* Is this the only image? */
-    if (item == gFirstImage && item->next == gFirstImage) {
-        gFirstImage = gCurImage = 0;
-    }
-    else {
-        /* Is it the first image? */
-        if (item == gFirstImage) {
-            if (gCurImage)
-                gCurImage = item->next;
-            gFirstImage = item->next;
-        }
+    index = IndexOfImage(item);
+    if (index < 0)
+        return;
 
-        /* Is it the last image? */
-        else if (item == gFirstImage->prev) {
-            gFirstImage->prev = item->prev;   // New last image
-            item->prev->next = gFirstImage;
-            if (gCurImage)
-                gCurImage = item->prev;
-        }
-        else if (gCurImage)
-            gCurImage = item->next;
+    FilterImageRemoved(index);
+    gImageList[index] = 0;
+    ++sNumRemoved;
+    CountRemoved(IndexToPosition(index), 1);
 
-        item->next->prev = item->prev;
-        item->prev->next = item->next;
+    if (index == gCurIndex) {
+        int pos = IndexToPosition(index);
+        i = NextPosition(pos);
+        if (i < 0)
+            i = PrevPosition(pos);
+        SetCurrentPosition(i);
     }
 
-    /* It's disconnected.  Free all the memory */
-    FreePhoImage(item);
+    /* Its record and strings stay allocated until ClearImageList() */
 
     /* What does the list look like now? */
     if (gDebug) {
@@ -98,45 +424,60 @@ void DeleteItem(PhoImage* item)
     }
 }
 
+/* Put a removed image back in its old slot */
+void RestoreItem(PhoImage* item, int index)
+{
+    if (!item || index < 0 || index >= gNumImages || gImageList[index])
+        return;
+
+    gImageList[index] = item;
+    --sNumRemoved;
+    CountRemoved(IndexToPosition(index), -1);
+    FilterImageAdded(index);
+}
+
 /* Append an item to the end of the list */
 void AppendItem(PhoImage* item)
 {
-    PhoImage* last;
-
     if (!item)
         return;
 
-    /* Is the list empty? */
-    if (gFirstImage == 0) {
-        gFirstImage = item;
-        item->next = item->prev = item;
-        return;
-    }
-
-    /* Is there only one item in the list? */
-    if (gFirstImage->next == gFirstImage) {
-        gFirstImage->next = gFirstImage->prev = item;
-        item->next = item->prev = gFirstImage;
-        return;
+    if (gNumImages >= sListSize) {
+        int newsize = sListSize ? sListSize * 2 : 64;
+        PhoImage** newlist = realloc(gImageList,
+                                     newsize * sizeof (PhoImage*));
+        int* newtree = realloc(sRemovedTree, (newsize + 1) * sizeof (int));
+        if (!newlist || !newtree) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(1);
+        }
+        gImageList = newlist;
+        sRemovedTree = newtree;
+        sListSize = newsize;
+        /* The new nodes cover old positions too; the list doubles,
+         * so recounting is still amortized O(1) per append.
+         */
+        RebuildRemovedTree();
     }
 
-    last = gFirstImage->prev;
-    last->next = item;
-    item->prev = last;
-    item->next = gFirstImage;
-    gFirstImage->prev = item;
+    gImageList[gNumImages++] = item;
+    FilterImageAdded(gNumImages - 1);
 }
 
 /* Remove all images from the image list, to start fresh. */
 void ClearImageList()
 {
-    PhoImage* img = gFirstImage;
-    do {
-        PhoImage* next = img->next;
-        FreePhoImage(img);
-        img = next;
-    } while (img && img != gFirstImage);
+    gNumImages = 0;
+    sNumRemoved = 0;
+    sShuffleCount = 0;
+    RebuildRemovedTree();
+    SetCurrentImage(-1);
+    RebuildFilterView();
+    ForgetDeletes();
+    ClearNoteIndex();
 
-    gCurImage = gFirstImage = 0;
+    sSlabsUsed = 0;
+    sSlabFill = PHO_SLAB_SIZE;
+    if (sStringPool)
+        g_string_chunk_clear(sStringPool);
 }
-
@@ -0,0 +1,260 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * session.c: saving the image list at exit and picking it up again.
+ *
+ * Copyright 2010 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+/* With --session file, pho saves the list in the order it was being
+ * shown, which image it was on, and each image's notes, rotation,
+ * size, caption and comment when it exits; next time, it carries on
+ * from there.
+ *
+ * The file is a header, then a fixed-size SessionRecord per image,
+ * then all the strings, NUL-terminated, which the records point to
+ * by offset. It's in the machine's own byte order, and is read by
+ * mapping it rather than parsing it: filenames, comments and captions
+ * point straight into the mapping, so resuming doesn't copy or even
+ * touch most of the file, however long the list is. The mapping is never
+ * unmapped, and saving writes a new file under a temporary name and
+ * renames it over the old one only if every write succeeded, so the
+ * old mapping stays valid and a failed save leaves the old file.
+ *
+ * The session's images come first in the list, wherever --session is
+ * on the command line.
+ */
+
+#include "pho.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SESSION_MAGIC "PHOSESS"
+#define SESSION_VERSION 1
+
+/* In place of a string offset, for a missing caption or comment */
+#define SESSION_NO_STRING 0xffffffffu
+
+typedef struct {
+    char magic[8];
+    guint32 version;        /* also catches files in the wrong byte order */
+    guint32 recordSize;
+    guint32 numImages;
+    guint32 curPos;
+    guint64 stringsSize;
+} SessionHeader;
+
+typedef struct {
+    guint32 filename;       /* offsets into the strings */
+    guint32 caption;
+    guint32 comment;
+    gint32 trueWidth, trueHeight;
+    gint16 curRot, exifRot;
+    NoteSet notes;
+} SessionRecord;
+
+/* The file named by --session, or 0 */
+char* gSessionFile = 0;
+
+/* Where str will go among the strings; counts it in *strsize */
+static guint32 SessionString(const char* str, guint64* strsize)
+{
+    guint64 off = *strsize;
+
+    if (!str)
+        return SESSION_NO_STRING;
+    *strsize += strlen(str) + 1;
+    return (guint32)off;
+}
+
+/* Save the images in the order they're shown, with curpos being the
+ * position of the current image. Returns 0 on success, -1 on error.
+ */
+int SaveSession(const char* filename, int curpos)
+{
+    char* tmpname = g_strdup_printf("%s.XXXXXX", filename);
+    int fd = g_mkstemp_full(tmpname, O_WRONLY, 0666);
+    FILE* fp = (fd >= 0 ? fdopen(fd, "w") : 0);
+    SessionHeader hdr;
+    guint64 strsize = 0;
+    int pos, ok;
+
+    if (!fp) {
+        perror(tmpname);
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmpname);
+        }
+        g_free(tmpname);
+        return -1;
+    }
+
+    memset(&hdr, 0, sizeof hdr);
+    strcpy(hdr.magic, SESSION_MAGIC);
+    hdr.version = SESSION_VERSION;
+    hdr.recordSize = sizeof (SessionRecord);
+    ok = (fwrite(&hdr, sizeof hdr, 1, fp) == 1);
+
+    /* Records first, working out where each string will go */
+    for (pos = 0; pos < gNumImages; ++pos) {
+        PhoImage* img = ImageAtPosition(pos);
+        SessionRecord rec;
+
+        if (!img || img->deleted)
+            continue;
+        if (pos < curpos)
+            ++hdr.curPos;
+
+        memset(&rec, 0, sizeof rec);
+        rec.filename = SessionString(img->filename, &strsize);
+        rec.caption = SessionString(img->caption, &strsize);
+        rec.comment = SessionString(img->comment, &strsize);
+        rec.trueWidth = img->trueWidth;
+        rec.trueHeight = img->trueHeight;
+        rec.curRot = img->curRot;
+        rec.exifRot = img->exifRot;
+        rec.notes = img->notes;
+        ok = ok && fwrite(&rec, sizeof rec, 1, fp) == 1;
+        ++hdr.numImages;
+    }
+
+    /* Then the strings, in the same order */
+    for (pos = 0; pos < gNumImages && ok; ++pos) {
+        PhoImage* img = ImageAtPosition(pos);
+
+        if (!img || img->deleted)
+            continue;
+        ok = (fwrite(img->filename, strlen(img->filename) + 1, 1, fp) == 1
+              && (!img->caption
+                  || fwrite(img->caption, strlen(img->caption) + 1, 1,
+                            fp) == 1)
+              && (!img->comment
+                  || fwrite(img->comment, strlen(img->comment) + 1, 1,
+                            fp) == 1));
+    }
+
+    /* Now the header can be filled in */
+    hdr.stringsSize = strsize;
+    if (!ok)
+        ;   /* errno says why */
+    else if (strsize >= SESSION_NO_STRING)
+        errno = EFBIG;
+    else if (fseek(fp, 0, SEEK_SET) == 0
+             && fwrite(&hdr, sizeof hdr, 1, fp) == 1
+             && fflush(fp) == 0 && fsync(fileno(fp)) == 0
+             && fclose(fp) == 0) {
+        fp = 0;
+        if (rename(tmpname, filename) == 0) {
+            if (gDebug)
+                printf("Saved %u images to %s\n", hdr.numImages, filename);
+            g_free(tmpname);
+            return 0;
+        }
+    }
+
+    perror(filename);
+    if (fp)
+        fclose(fp);
+    unlink(tmpname);
+    g_free(tmpname);
+    return -1;
+}
+
+/* Add the images saved in filename to the end of the list.
+ * Returns the position of the image that was current when it was
+ * saved, or -1 if there's no such session file.
+ */
+int ResumeSession(const char* filename)
+{
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    const char* map;
+    const SessionHeader* hdr;
+    const SessionRecord* recs;
+    const char* strings;
+    int firstPos = gNumImages;
+    guint32 i;
+
+    if (fd < 0) {
+        if (errno != ENOENT)
+            perror(filename);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0) {
+        perror(filename);
+        close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof (SessionHeader)) {
+        fprintf(stderr, "%s isn't a pho session file\n", filename);
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(filename);
+        return -1;
+    }
+
+    hdr = (const SessionHeader*)map;
+    recs = (const SessionRecord*)(map + sizeof (SessionHeader));
+
+    /* Check the sizes add up, and that the last string is terminated,
+     * so that every string must be.
+     */
+    if (memcmp(hdr->magic, SESSION_MAGIC, sizeof hdr->magic)
+        || hdr->version != SESSION_VERSION
+        || hdr->recordSize != sizeof (SessionRecord)
+        || hdr->numImages > (st.st_size - sizeof (SessionHeader))
+                            / sizeof (SessionRecord)
+        || sizeof (SessionHeader) + hdr->numImages * sizeof (SessionRecord)
+               + hdr->stringsSize != (guint64)st.st_size
+        || (hdr->stringsSize > 0
+            && map[st.st_size - 1] != '\0')) {
+        fprintf(stderr, "%s isn't a pho session file, or is damaged\n",
+                filename);
+        munmap((void*)map, st.st_size);
+        return -1;
+    }
+    strings = (const char*)(recs + hdr->numImages);
+    madvise((void*)map, st.st_size, MADV_SEQUENTIAL);
+
+    for (i = 0; i < hdr->numImages; ++i) {
+        const SessionRecord* rec = recs + i;
+        PhoImage* img;
+
+        if (rec->filename >= hdr->stringsSize)
+            continue;
+        if (!(img = AllocPhoImage())) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(1);
+        }
+        img->filename = (char*)strings + rec->filename;
+        if (rec->caption < hdr->stringsSize)
+            img->caption = (char*)strings + rec->caption;
+        if (rec->comment < hdr->stringsSize)
+            img->comment = (char*)strings + rec->comment;
+        img->trueWidth = rec->trueWidth;
+        img->trueHeight = rec->trueHeight;
+        img->curRot = rec->curRot;
+        img->exifRot = rec->exifRot;
+        img->notes = rec->notes;
+        AppendItem(img);
+        IndexNotes(img, gNumImages - 1);
+        JournalRestore(img);
+    }
+
+    if (gDebug)
+        printf("Resumed %u images from %s\n", hdr->numImages, filename);
+
+    return firstPos + (hdr->curPos < hdr->numImages ? hdr->curPos : 0);
+}
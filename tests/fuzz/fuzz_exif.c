@@ -0,0 +1,270 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * fuzz_exif.c: fuzzing and throughput harness for the exif/ parser.
+ *
+ * Drives ReadJpegSections() -> process_EXIF() -> ProcessExifDir()
+ * from memory buffers, the same path pho takes for every file it opens.
+ *
+ * Built with -DPHO_LIBFUZZER (and -fsanitize=fuzzer), this is just
+ * the libFuzzer entry point. Otherwise it's a standalone driver:
+ *
+ *   fuzz_exif file|dir ...              parse each input once (replay)
+ *   fuzz_exif -b [-n iters] file|dir ...  benchmark: parses/s and bytes/s
+ */
+
+#define _GNU_SOURCE     /* for fmemopen() */
+
+#include "jhead.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <setjmp.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+
+/* jhead.c's ErrFatal() calls exit(), which would look like a crash
+ * to a fuzzer and would end a benchmark run. So instead of linking
+ * jhead.o we supply the few symbols the parser needs from it,
+ * and turn fatal errors into a longjmp back to ParseBuffer().
+ */
+int ShowTags = FALSE;
+
+static jmp_buf sFatalJmp;
+
+void ErrFatal(char* msg)
+{
+    (void)msg;
+    longjmp(sFatalJmp, 1);
+}
+
+void ErrNonfatal(char* msg, int a1, int a2)
+{
+    (void)msg; (void)a1; (void)a2;
+}
+
+/* Parse one in-memory JPEG the way ProcessFile() would.
+ * Returns 1 if the parser accepted the headers, 0 if it rejected them,
+ * -1 if it hit a fatal error. If consumed is non-null, it's set to
+ * the number of bytes the parser read (it stops at the first scan).
+ */
+static int ParseBuffer(const uint8_t* data, size_t size, size_t* consumed)
+{
+    FILE* infile;
+    volatile int ret;
+
+    if (consumed)
+        *consumed = 0;
+
+    /* fmemopen() won't take an empty buffer */
+    if (size == 0)
+        return 0;
+
+    /* Mode "r" never writes, so casting away const is safe */
+    infile = fmemopen((void*)data, size, "r");
+    if (!infile)
+        return 0;
+
+    ResetJpgfile();
+    memset(&ImageInfo, 0, sizeof(ImageInfo));
+    ImageInfo.FlashUsed = -1;
+    ImageInfo.MeteringMode = -1;
+
+    if (setjmp(sFatalJmp) == 0)
+        ret = ReadJpegSections(infile, READ_EXIF);
+    else
+        ret = -1;
+
+    if (consumed) {
+        long pos = ftell(infile);
+        *consumed = (pos > 0 ? (size_t)pos : 0);
+    }
+    fclose(infile);
+    DiscardData();
+    return ret;
+}
+
+#ifdef PHO_LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    ParseBuffer(data, size, 0);
+    return 0;
+}
+
+#else /* PHO_LIBFUZZER */
+
+typedef struct {
+    char* name;
+    uint8_t* data;
+    size_t size;
+} Input;
+
+static Input* sInputs = 0;
+static int sNumInputs = 0;
+static int sMaxInputs = 0;
+
+static void AddInputFile(const char* name)
+{
+    FILE* fp;
+    struct stat st;
+    uint8_t* data;
+
+    if (stat(name, &st) < 0 || !S_ISREG(st.st_mode))
+        return;
+
+    fp = fopen(name, "rb");
+    if (!fp) {
+        perror(name);
+        return;
+    }
+    /* Allocate at least one byte so empty inputs still get a buffer */
+    data = malloc(st.st_size ? st.st_size : 1);
+    if (!data || fread(data, 1, st.st_size, fp) != (size_t)st.st_size) {
+        fprintf(stderr, "Couldn't read %s\n", name);
+        free(data);
+        fclose(fp);
+        return;
+    }
+    fclose(fp);
+
+    if (sNumInputs >= sMaxInputs) {
+        int newmax = sMaxInputs ? sMaxInputs * 2 : 64;
+        Input* newinputs = realloc(sInputs, newmax * sizeof(Input));
+        if (!newinputs) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(1);
+        }
+        sInputs = newinputs;
+        sMaxInputs = newmax;
+    }
+    sInputs[sNumInputs].name = strdup(name);
+    sInputs[sNumInputs].data = data;
+    sInputs[sNumInputs].size = st.st_size;
+    ++sNumInputs;
+}
+
+/* Add a file, or every regular file in a directory (a corpus). */
+static void AddInput(const char* name)
+{
+    struct stat st;
+    DIR* dir;
+    struct dirent* ent;
+
+    if (stat(name, &st) < 0) {
+        perror(name);
+        return;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        AddInputFile(name);
+        return;
+    }
+
+    dir = opendir(name);
+    if (!dir) {
+        perror(name);
+        return;
+    }
+    while ((ent = readdir(dir)) != 0) {
+        char path[PATH_MAX];
+        if (ent->d_name[0] == '.')
+            continue;
+        if (snprintf(path, sizeof(path), "%s/%s", name, ent->d_name)
+            >= (int)sizeof(path))
+            continue;
+        AddInputFile(path);
+    }
+    closedir(dir);
+}
+
+static double Now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Parse every input once, reporting what the parser made of it. */
+static int Replay()
+{
+    int i;
+    for (i = 0; i < sNumInputs; ++i) {
+        int ret = ParseBuffer(sInputs[i].data, sInputs[i].size, 0);
+        printf("%s: %s\n", sInputs[i].name,
+               ret > 0 ? "ok" : (ret == 0 ? "rejected" : "fatal error"));
+    }
+    return 0;
+}
+
+/* Parse every input iters times and report throughput.
+ * bytes/s counts only the header bytes the parser actually read,
+ * not the compressed image data after the start of scan.
+ */
+static int Benchmark(long iters)
+{
+    long it;
+    int i;
+    double start, elapsed;
+    unsigned long long parses = 0, bytes = 0;
+
+    /* One untimed pass to warm the caches */
+    for (i = 0; i < sNumInputs; ++i)
+        ParseBuffer(sInputs[i].data, sInputs[i].size, 0);
+
+    start = Now();
+    for (it = 0; it < iters; ++it) {
+        for (i = 0; i < sNumInputs; ++i) {
+            size_t consumed;
+            ParseBuffer(sInputs[i].data, sInputs[i].size, &consumed);
+            bytes += consumed;
+        }
+        parses += sNumInputs;
+    }
+    elapsed = Now() - start;
+    if (elapsed <= 0)
+        elapsed = 1e-9;
+
+    printf("%d inputs, %ld iterations: %llu parses in %.3f s\n",
+           sNumInputs, iters, parses, elapsed);
+    printf("%.0f parses/s, %.2f MB/s\n",
+           parses / elapsed, bytes / elapsed / (1024. * 1024.));
+    return 0;
+}
+
+static void Usage()
+{
+    printf("Usage: fuzz_exif [-b] [-n iterations] file|corpus-dir ...\n");
+    printf("\t-b:  Benchmark: report parses/s and bytes/s\n");
+    printf("\t-nN: Number of passes over the inputs in benchmark mode\n");
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    int bench = 0;
+    long iters = 1000;
+    int i;
+
+    for (i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-b"))
+            bench = 1;
+        else if (!strncmp(argv[i], "-n", 2)) {
+            const char* num = argv[i][2] ? argv[i] + 2 : argv[++i];
+            if (!num || (iters = atol(num)) <= 0)
+                Usage();
+        }
+        else if (argv[i][0] == '-')
+            Usage();
+        else
+            AddInput(argv[i]);
+    }
+
+    if (sNumInputs == 0)
+        Usage();
+
+    return bench ? Benchmark(iters) : Replay();
+}
+
+#endif /* PHO_LIBFUZZER */
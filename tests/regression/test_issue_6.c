@@ -5,26 +5,23 @@
 #include "../unity/unity.h"
 #include "../../pho.h"
 
-extern PhoImage* gFirstImage;
-extern PhoImage* gCurImage;
 extern int gDelayMillis;
 extern int gPendingTimeout;
 
 static int should_add_timeout(void) {
     return (gDelayMillis > 0 && gPendingTimeout == 0
-        && (gCurImage->next != 0 && gCurImage->next != gFirstImage));
+        && NextPosition(CurrentPosition()) >= 0);
 }
 
 void setUp(void) {
-    gFirstImage = NULL; gCurImage = NULL;
+    ClearImageList();
     gDelayMillis = 1000; gPendingTimeout = 0;
 }
-void tearDown(void) {}
+void tearDown(void) { ClearImageList(); }
 
 void test_slideshow_not_added_at_end(void) {
-    PhoImage img;
-    gFirstImage = &img; gCurImage = &img;
-    img.next = &img; img.prev = &img;
+    AppendItem(NewPhoImage("only.jpg"));
+    SetCurrentImage(0);
     TEST_ASSERT_EQUAL_INT(0, should_add_timeout());
 }
 
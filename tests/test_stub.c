@@ -15,6 +15,7 @@ PhoImage* AddImage(char* filename) {
     PhoImage* img = NewPhoImage(filename);
     if (img) {
         AppendItem(img);
+        JournalRestore(img);
     }
     return img;
 }
@@ -0,0 +1,99 @@
+/* Unit tests for dirscan.c */
+#include "../unity/unity.h"
+#include "../../pho.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void setUp(void) { ClearImageList(); }
+void tearDown(void) { ClearImageList(); }
+
+void test_looks_like_image_magic(void) {
+    const unsigned char jpeg[] = { 0xff, 0xd8, 0xff, 0xe1 };
+    const unsigned char png[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    TEST_ASSERT_TRUE(LooksLikeImage(jpeg, sizeof jpeg));
+    TEST_ASSERT_TRUE(LooksLikeImage(png, sizeof png));
+    TEST_ASSERT_TRUE(LooksLikeImage((const unsigned char*)"GIF89a", 6));
+    TEST_ASSERT_FALSE(LooksLikeImage((const unsigned char*)"hello world", 11));
+    TEST_ASSERT_FALSE(LooksLikeImage(jpeg, 2));
+}
+
+void test_add_directory_finds_images(void) {
+    int i;
+    AddDirectory("../test-img");
+    WaitForDirScans(1);
+    TEST_ASSERT_FALSE(DirScansPending());
+    TEST_ASSERT_EQUAL_INT(9, CountImages());
+    /* Images from one directory come in name order */
+    for (i = 1; i < gNumImages; ++i)
+        TEST_ASSERT_TRUE(strcmp(ImageAt(i-1)->filename,
+                                ImageAt(i)->filename) < 0);
+}
+
+/* Directories finish being read in any order, but a tree's images
+ * always come out in the order of their full paths, so the same seed
+ * gives the same shuffle every time.
+ */
+void test_add_directory_order_is_repeatable(void) {
+    static const char* dirs[] = { "a", "a/b", "a/bb", "b", "b/x", "b/x/y" };
+    static const char* files[] = { "1.jpg", "b.jpg", "b-c.jpg", "z.jpg" };
+    char root[] = "/tmp/pho-dirscan-XXXXXX";
+    char** first;
+    int run, i, j, n = 0;
+
+    TEST_ASSERT_NOT_NULL(mkdtemp(root));
+    for (i = 0; i < (int)G_N_ELEMENTS(dirs); ++i) {
+        char* dir = g_build_filename(root, dirs[i], NULL);
+        TEST_ASSERT_EQUAL_INT(0, g_mkdir_with_parents(dir, 0700));
+        for (j = 0; j < (int)G_N_ELEMENTS(files); ++j) {
+            char* file = g_build_filename(dir, files[j], NULL);
+            TEST_ASSERT_TRUE(g_file_set_contents(file, "\xff\xd8\xff", 3, 0));
+            g_free(file);
+        }
+        g_free(dir);
+    }
+    first = g_new0(char*, G_N_ELEMENTS(dirs) * G_N_ELEMENTS(files));
+
+    for (run = 0; run < 2; ++run) {
+        ClearImageList();
+        AddDirectory(root);
+        WaitForDirScans(1);
+        TEST_ASSERT_EQUAL_INT(G_N_ELEMENTS(dirs) * G_N_ELEMENTS(files),
+                              CountImages());
+        for (i = 1; i < gNumImages; ++i)
+            TEST_ASSERT_TRUE(strcmp(ImageAt(i-1)->filename,
+                                    ImageAt(i)->filename) < 0);
+
+        ShuffleImages(42);
+        for (i = 0; i < gNumImages; ++i) {
+            char* name = ImageAtPosition(i)->filename;
+            if (run == 0)
+                first[n++] = g_strdup(name);
+            else
+                TEST_ASSERT_EQUAL_STRING(first[i], name);
+        }
+    }
+
+    for (i = 0; i < n; ++i)
+        g_free(first[i]);
+    g_free(first);
+    for (i = G_N_ELEMENTS(dirs) - 1; i >= 0; --i) {
+        char* dir = g_build_filename(root, dirs[i], NULL);
+        for (j = 0; j < (int)G_N_ELEMENTS(files); ++j) {
+            char* file = g_build_filename(dir, files[j], NULL);
+            unlink(file);
+            g_free(file);
+        }
+        rmdir(dir);
+        g_free(dir);
+    }
+    rmdir(root);
+}
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_looks_like_image_magic);
+    RUN_TEST(test_add_directory_finds_images);
+    RUN_TEST(test_add_directory_order_is_repeatable);
+    return UNITY_END();
+}
@@ -1,12 +1,16 @@
 /* Unit tests for pho.c */
 #include "../unity/unity.h"
 #include "../../pho.h"
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 static PhoImage* test_img = NULL;
 
+/* PhoImage records belong to the image list's slabs, not to the test */
 void setUp(void) { test_img = NULL; }
-void tearDown(void) { if (test_img) { free(test_img); test_img = NULL; } }
+void tearDown(void) { test_img = NULL; ClearImageList(); }
 
 void test_new_pho_image_allocates_memory(void) {
     test_img = NewPhoImage("test.jpg");
@@ -18,6 +22,13 @@ void test_new_pho_image_sets_filename(void) {
     TEST_ASSERT_EQUAL_STRING("test.jpg", test_img->filename);
 }
 
+void test_new_pho_image_copies_filename(void) {
+    char name[] = "test.jpg";
+    test_img = NewPhoImage(name);
+    name[0] = 'X';
+    TEST_ASSERT_EQUAL_STRING("test.jpg", test_img->filename);
+}
+
 void test_scale_to_fit_no_scaling_needed(void) {
     int width = 400, height = 300;
     ScaleToFit(&width, &height, 800, 600, PHO_SCALE_SCREEN_RATIO, 1.0);
@@ -25,10 +36,419 @@ void test_scale_to_fit_no_scaling_needed(void) {
     TEST_ASSERT_EQUAL_INT(300, height);
 }
 
+static void make_list(int n) {
+    int i;
+    ClearImageList();
+    for (i = 0; i < n; ++i)
+        AppendItem(NewPhoImage("test.jpg"));
+}
+
+void test_parse_image_position_number(void) {
+    make_list(200);
+    TEST_ASSERT_EQUAL_INT(0, ParseImagePosition("1"));
+    TEST_ASSERT_EQUAL_INT(119, ParseImagePosition("120"));
+    TEST_ASSERT_EQUAL_INT(199, ParseImagePosition("5000"));
+    TEST_ASSERT_EQUAL_INT(-1, ParseImagePosition("abc"));
+    TEST_ASSERT_EQUAL_INT(-1, ParseImagePosition("nan"));
+    ClearImageList();
+}
+
+void test_parse_image_position_percent(void) {
+    make_list(201);
+    TEST_ASSERT_EQUAL_INT(0, ParseImagePosition("0%"));
+    TEST_ASSERT_EQUAL_INT(100, ParseImagePosition("50%"));
+    TEST_ASSERT_EQUAL_INT(200, ParseImagePosition("100%"));
+    TEST_ASSERT_EQUAL_INT(-1, ParseImagePosition("50%x"));
+    TEST_ASSERT_EQUAL_INT(-1, ParseImagePosition("nan%"));
+    ClearImageList();
+}
+
+void test_parse_image_position_skips_removed(void) {
+    make_list(10);
+    DeleteItem(ImageAt(0));
+    DeleteItem(ImageAt(5));
+    TEST_ASSERT_EQUAL_INT(8, CountImages());
+    TEST_ASSERT_EQUAL_INT(1, ParseImagePosition("1"));
+    TEST_ASSERT_EQUAL_INT(6, ParseImagePosition("5"));
+    TEST_ASSERT_EQUAL_INT(9, ParseImagePosition("8"));
+    TEST_ASSERT_EQUAL_INT(9, ParseImagePosition("100%"));
+    TEST_ASSERT_EQUAL_INT(4, LiveRank(6));
+    ClearImageList();
+}
+
+void test_delete_can_be_undone(void) {
+    PhoImage* a = AddImage("a.jpg");
+    PhoImage* b = AddImage("b.jpg");
+    SetCurrentImage(0);
+    QueueDelete(a);
+    TEST_ASSERT_TRUE(a->deleted);
+    TEST_ASSERT_NULL(ImageAt(0));
+    TEST_ASSERT_EQUAL_PTR(b, gCurImage);
+
+    TEST_ASSERT_EQUAL_INT(0, UndoDelete());
+    TEST_ASSERT_FALSE(a->deleted);
+    TEST_ASSERT_EQUAL_PTR(a, ImageAt(0));
+    TEST_ASSERT_EQUAL_PTR(a, gCurImage);
+    TEST_ASSERT_EQUAL_INT(2, CountImages());
+    TEST_ASSERT_EQUAL_INT(-1, UndoDelete());
+}
+
+extern void AddImgToList(GString** strp, char* str);
+
+void test_add_img_to_list_quotes_and_separates(void) {
+    GString* list = 0;
+    AddImgToList(&list, "a.jpg");
+    AddImgToList(&list, "b c.jpg");
+    AddImgToList(&list, "d.jpg");
+    TEST_ASSERT_EQUAL_STRING("a.jpg \"b c.jpg\" d.jpg", list->str);
+    g_string_free(list, TRUE);
+}
+
+void test_journal_restores_changes(void) {
+    char jname[] = "/tmp/pho-journal-XXXXXX";
+    PhoImage* img;
+    int fd = mkstemp(jname);
+    TEST_ASSERT_TRUE(fd >= 0);
+    close(fd);
+
+    img = AddImage("a b.jpg");
+    OpenJournal(jname);
+    SetNote(img, 3, 1);
+    SetNote(img, 100, 1);
+    img->curRot = 90;
+    JournalRotation(img);
+    img->comment = PoolString("tab\there");
+    JournalComment(img);
+    CloseJournal();
+
+    ClearImageList();
+    img = AddImage("a b.jpg");
+    OpenJournal(jname);
+    CloseJournal();
+    TEST_ASSERT_TRUE(HasNote(img, 3));
+    TEST_ASSERT_TRUE(HasNote(img, 100));
+    TEST_ASSERT_EQUAL_INT(90, img->curRot);
+    TEST_ASSERT_EQUAL_STRING("tab\there", img->comment);
+    unlink(jname);
+}
+
+void test_session_saves_order_and_position(void) {
+    char sname[] = "/tmp/pho-session-XXXXXX";
+    PhoImage *a, *b, *c;
+    int fd = mkstemp(sname);
+    TEST_ASSERT_TRUE(fd >= 0);
+    close(fd);
+
+    a = AddImage("a.jpg");
+    b = AddImage("b.jpg");
+    c = AddImage("c.jpg");
+    SetNote(c, 200, 1);
+    c->curRot = 270;
+    c->comment = PoolString("last one");
+    DeleteItem(a);
+    TEST_ASSERT_EQUAL_INT(0, SaveSession(sname, IndexOfImage(c)));
+
+    ClearImageList();
+    TEST_ASSERT_EQUAL_INT(1, ResumeSession(sname));
+    TEST_ASSERT_EQUAL_INT(2, CountImages());
+    b = ImageAt(0);
+    c = ImageAt(1);
+    TEST_ASSERT_EQUAL_STRING("b.jpg", b->filename);
+    TEST_ASSERT_EQUAL_STRING("c.jpg", c->filename);
+    TEST_ASSERT_TRUE(HasNote(c, 200));
+    TEST_ASSERT_EQUAL_INT(1, NoteCount(200));
+    TEST_ASSERT_EQUAL_INT(270, c->curRot);
+    TEST_ASSERT_EQUAL_STRING("last one", c->comment);
+    TEST_ASSERT_NULL(b->comment);
+    unlink(sname);
+}
+
+void test_notes_format_records(void) {
+    PhoImage* img = AddImage("my \"pic\".jpg");
+    GString* out = g_string_new("");
+
+    SetNote(img, 2, 1);
+    SetNote(img, 70, 1);
+    img->curRot = 90;
+    FormatNoteRecord(out, img, PHO_NOTES_JSON);
+    TEST_ASSERT_EQUAL_STRING("{\"file\":\"my \\\"pic\\\".jpg\",\"rotation\":90,"
+                             "\"exif_rotation\":0,\"wrong_exif\":true,"
+                             "\"notes\":[2,70],\"caption\":\"\"}\n", out->str);
+
+    g_string_truncate(out, 0);
+    img->caption = PoolString("a\tb");
+    FormatNoteRecord(out, img, PHO_NOTES_TSV);
+    TEST_ASSERT_EQUAL_STRING("my \"pic\".jpg\t90\t0\t1\t2,70\ta\\tb\n", out->str);
+    g_string_free(out, TRUE);
+}
+
+void test_global_captions_any_length(void) {
+    char cname[] = "/tmp/pho-captions-XXXXXX";
+    PhoImage *a, *b, *c;
+    FILE* fp;
+    int i, fd = mkstemp(cname);
+    TEST_ASSERT_TRUE(fd >= 0);
+
+    fp = fdopen(fd, "w");
+    fprintf(fp, "a.jpg: first\r\n\nb.jpg:   ");
+    for (i = 0; i < 20000; ++i)
+        fputc('x', fp);
+    fprintf(fp, "\na.jpg: second\n");
+    fclose(fp);
+
+    gCapFileFormat = cname;
+    a = AddImage("a.jpg");
+    b = AddImage("b.jpg");
+    c = AddImage("c.jpg");
+    ReadCaption(a);
+    ReadCaption(b);
+    ReadCaption(c);
+    TEST_ASSERT_EQUAL_STRING("first", a->caption);
+    TEST_ASSERT_EQUAL_INT(20000, strlen(b->caption));
+    TEST_ASSERT_NULL(c->caption);
+    gCapFileFormat = "Captions";
+    unlink(cname);
+}
+
+void test_caption_files_read_in_background(void) {
+    char dir[] = "/tmp/pho-capfiles-XXXXXX";
+    char *apath, *bpath, *capname;
+    PhoImage *a, *b;
+
+    TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+    apath = g_build_filename(dir, "a.jpg", NULL);
+    bpath = g_build_filename(dir, "b.jpg", NULL);
+    capname = g_strdup_printf("%s.txt", apath);
+    TEST_ASSERT_TRUE(g_file_set_contents(capname, "two\nlines", -1, 0));
+
+    gCapFileFormat = "%s.txt";
+    a = AddImage(apath);
+    b = AddImage(bpath);
+    ReadCaption(a);
+    while (CaptionsPending())
+        g_main_context_iteration(NULL, TRUE);
+    TEST_ASSERT_EQUAL_STRING("two lines", a->caption);
+    TEST_ASSERT_NULL(b->caption);
+    gCapFileFormat = "Captions";
+
+    unlink(capname);
+    rmdir(dir);
+    g_free(apath);
+    g_free(bpath);
+    g_free(capname);
+}
+
+void test_only_changed_captions_written(void) {
+    char dir[] = "/tmp/pho-capwrite-XXXXXX";
+    char *apath, *bpath, *acap, *bcap, *text;
+    PhoImage *a, *b;
+
+    TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+    apath = g_build_filename(dir, "a.jpg", NULL);
+    bpath = g_build_filename(dir, "b.jpg", NULL);
+    acap = g_strdup_printf("%s.txt", apath);
+    bcap = g_strdup_printf("%s.txt", bpath);
+
+    gCapFileFormat = "%s.txt";
+    a = AddImage(apath);
+    b = AddImage(bpath);
+    a->caption = PoolString("edited");
+    b->caption = PoolString("untouched");
+    MarkCaptionDirty(a);
+    FinishCaptionWrites();
+    TEST_ASSERT_TRUE(g_file_get_contents(acap, &text, 0, 0));
+    TEST_ASSERT_EQUAL_STRING("edited", text);
+    g_free(text);
+    TEST_ASSERT_FALSE(g_file_test(bcap, G_FILE_TEST_EXISTS));
+
+    /* Emptying a caption removes its file */
+    a->caption[0] = '\0';
+    MarkCaptionDirty(a);
+    FinishCaptionWrites();
+    TEST_ASSERT_FALSE(g_file_test(acap, G_FILE_TEST_EXISTS));
+    gCapFileFormat = "Captions";
+
+    rmdir(dir);
+    g_free(apath);
+    g_free(bpath);
+    g_free(acap);
+    g_free(bcap);
+}
+
+void test_xmp_sidecar_round_trip(void) {
+    char dir[] = "/tmp/pho-xmp-XXXXXX";
+    char *path, *xmpname, *text;
+    PhoImage* img;
+
+    TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+    path = g_build_filename(dir, "a.jpg", NULL);
+    xmpname = g_strdup_printf("%s.xmp", path);
+
+    gUseXmp = 1;
+    img = AddImage(path);
+    SetNote(img, 3, 1);
+    SetNote(img, 200, 1);
+    img->caption = PoolString("Fish & <chips>");
+    img->curRot = 90;
+    img->trueWidth = img->trueHeight = 100;     /* it's been loaded */
+    MarkXmpDirty(img);
+    FinishXmpWrites();
+    TEST_ASSERT_TRUE(g_file_get_contents(xmpname, &text, 0, 0));
+    TEST_ASSERT_NOT_NULL(strstr(text, "tiff:Orientation=\"6\""));
+    g_free(text);
+
+    /* A fresh image for the same file picks it all up again */
+    ClearImageList();
+    img = AddImage(path);
+    LoadXmp(img);
+    while (XmpReadsPending())
+        g_main_context_iteration(NULL, TRUE);
+    TEST_ASSERT_TRUE(HasNote(img, 3));
+    TEST_ASSERT_TRUE(HasNote(img, 200));
+    TEST_ASSERT_FALSE(HasNote(img, 0));
+    TEST_ASSERT_EQUAL_STRING("Fish & <chips>", img->caption);
+    TEST_ASSERT_EQUAL_INT(90, img->curRot);
+    TEST_ASSERT_TRUE(XmpHasRotation(img));
+    TEST_ASSERT_FALSE(img->xmpDirty);
+    gUseXmp = 0;
+
+    unlink(xmpname);
+    rmdir(dir);
+    g_free(path);
+    g_free(xmpname);
+}
+
+void test_xmp_journal_keeps_foreign_sidecar(void) {
+    char dir[] = "/tmp/pho-xmp-XXXXXX";
+    char jname[] = "/tmp/pho-journal-XXXXXX";
+    char *path, *xmpname, *text;
+    PhoImage* img;
+    int fd = mkstemp(jname);
+    TEST_ASSERT_TRUE(fd >= 0);
+    close(fd);
+
+    TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+    path = g_build_filename(dir, "a.jpg", NULL);
+    xmpname = g_strdup_printf("%s.xmp", path);
+
+    /* Another program's sidecar */
+    TEST_ASSERT_TRUE(g_file_set_contents(xmpname,
+        "<x:xmpmeta xmlns:x=\"adobe:ns:meta/\">\n"
+        " <rdf:RDF xmlns:rdf=\"http://www.w3.org/1999/02/22-rdf-syntax-ns#\">\n"
+        "  <rdf:Description rdf:about=\"\" tiff:Orientation=\"6\">\n"
+        "   <dc:subject><rdf:Bag><rdf:li>Lighthouse</rdf:li></rdf:Bag>"
+        "</dc:subject>\n"
+        "   <dc:description><rdf:Alt>"
+        "<rdf:li xml:lang=\"x-default\">At dusk</rdf:li></rdf:Alt>"
+        "</dc:description>\n"
+        "  </rdf:Description>\n"
+        " </rdf:RDF>\n"
+        "</x:xmpmeta>\n", -1, 0));
+
+    /* A journal from a session without --xmp */
+    img = AddImage(path);
+    OpenJournal(jname);
+    SetNote(img, 5, 1);
+    CloseJournal();
+
+    /* Restoring it, before the image is ever shown, mustn't lose
+     * what was in the sidecar.
+     */
+    ClearImageList();
+    gUseXmp = 1;
+    img = AddImage(path);
+    OpenJournal(jname);
+    CloseJournal();
+    FinishXmpWrites();
+
+    TEST_ASSERT_TRUE(HasNote(img, 5));
+    TEST_ASSERT_EQUAL_INT(90, img->curRot);
+    TEST_ASSERT_EQUAL_STRING("At dusk", img->caption);
+    TEST_ASSERT_TRUE(g_file_get_contents(xmpname, &text, 0, 0));
+    TEST_ASSERT_NOT_NULL(strstr(text, "<rdf:li>Lighthouse</rdf:li>"));
+    TEST_ASSERT_NOT_NULL(strstr(text, "At dusk"));
+    TEST_ASSERT_NOT_NULL(strstr(text, "tiff:Orientation=\"6\""));
+    TEST_ASSERT_NOT_NULL(strstr(text, "<rdf:li>5</rdf:li>"));
+    g_free(text);
+    gUseXmp = 0;
+
+    unlink(xmpname);
+    unlink(jname);
+    rmdir(dir);
+    g_free(path);
+    g_free(xmpname);
+}
+
+/* Let idles and draws run, as the main loop would between events */
+static void run_main_loop(void) {
+    while (g_main_context_iteration(NULL, FALSE))
+        ;
+}
+
+void test_render_once_per_navigation(void) {
+    PhoRenderStats start;
+
+    if (!gtk_init_check(0, 0))
+        TEST_IGNORE_MESSAGE("No display to render to");
+    gPhysMonitorWidth = gMonitorWidth = 800;
+    gPhysMonitorHeight = gMonitorHeight = 600;
+    AddImage("../test-img/1.jpg");
+    AddImage("../test-img/2.jpg");
+
+    /* Asking more than once before the main loop gets to it */
+    start = gRenderStats;
+    TEST_ASSERT_EQUAL_INT(0, NextImage());
+    ScaleAndRotate(gCurImage, 0);
+    ShowImage();
+    run_main_loop();
+    TEST_ASSERT_EQUAL_UINT(1, gRenderStats.decodes - start.decodes);
+    TEST_ASSERT_EQUAL_UINT(1, gRenderStats.commits - start.commits);
+    TEST_ASSERT_TRUE(gRenderStats.resamples - start.resamples <= 1);
+
+    /* The next image, rotated before it's drawn */
+    start = gRenderStats;
+    TEST_ASSERT_EQUAL_INT(0, NextImage());
+    ScaleAndRotate(gCurImage, 90);
+    run_main_loop();
+    TEST_ASSERT_EQUAL_UINT(1, gRenderStats.decodes - start.decodes);
+    TEST_ASSERT_EQUAL_UINT(1, gRenderStats.commits - start.commits);
+    TEST_ASSERT_EQUAL_UINT(1, gRenderStats.rotations - start.rotations);
+    TEST_ASSERT_TRUE(gRenderStats.resamples - start.resamples <= 1);
+    TEST_ASSERT_TRUE(gRenderStats.paints - start.paints <= 1);
+    TEST_ASSERT_EQUAL_INT(90, gCurImage->curRot);
+
+    /* A new scale mode; getting bigger may mean decoding again */
+    start = gRenderStats;
+    SetViewModes(gDisplayMode, PHO_SCALE_FULLSCREEN, 1.0);
+    run_main_loop();
+    TEST_ASSERT_TRUE(gRenderStats.decodes - start.decodes <= 1);
+    TEST_ASSERT_EQUAL_UINT(1, gRenderStats.commits - start.commits);
+    TEST_ASSERT_TRUE(gRenderStats.rotations - start.rotations <= 1);
+    TEST_ASSERT_TRUE(gRenderStats.resamples - start.resamples <= 1);
+    TEST_ASSERT_TRUE(gRenderStats.paints - start.paints <= 1);
+    TEST_ASSERT_EQUAL_INT(90, gCurImage->curRot);
+    SetViewModes(gDisplayMode, PHO_SCALE_NORMAL, 1.0);
+}
+
 int main(void) {
     UNITY_BEGIN();
     RUN_TEST(test_new_pho_image_allocates_memory);
     RUN_TEST(test_new_pho_image_sets_filename);
+    RUN_TEST(test_new_pho_image_copies_filename);
     RUN_TEST(test_scale_to_fit_no_scaling_needed);
+    RUN_TEST(test_parse_image_position_number);
+    RUN_TEST(test_parse_image_position_percent);
+    RUN_TEST(test_parse_image_position_skips_removed);
+    RUN_TEST(test_delete_can_be_undone);
+    RUN_TEST(test_add_img_to_list_quotes_and_separates);
+    RUN_TEST(test_journal_restores_changes);
+    RUN_TEST(test_session_saves_order_and_position);
+    RUN_TEST(test_notes_format_records);
+    RUN_TEST(test_global_captions_any_length);
+    RUN_TEST(test_caption_files_read_in_background);
+    RUN_TEST(test_only_changed_captions_written);
+    RUN_TEST(test_xmp_sidecar_round_trip);
+    RUN_TEST(test_xmp_journal_keeps_foreign_sidecar);
+    RUN_TEST(test_render_once_per_navigation);
     return UNITY_END();
 }
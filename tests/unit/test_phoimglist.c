@@ -2,29 +2,239 @@
 #include "../unity/unity.h"
 #include "../../pho.h"
 #include <stdlib.h>
+#include <string.h>
 
-extern PhoImage* gFirstImage;
-extern PhoImage* gCurImage;
-
-void setUp(void) { gFirstImage = NULL; gCurImage = NULL; }
-void tearDown(void) { if (gFirstImage) ClearImageList(); }
+void setUp(void) { ClearImageList(); }
+void tearDown(void) { SetImageFilter(0); ClearImageList(); }
 
 void test_append_item_to_empty_list(void) {
     PhoImage* img = NewPhoImage("test.jpg");
     AppendItem(img);
-    TEST_ASSERT_EQUAL_PTR(img, gFirstImage);
+    TEST_ASSERT_EQUAL_PTR(img, gImageList[0]);
+    TEST_ASSERT_EQUAL_INT(1, CountImages());
 }
 
 void test_delete_only_item(void) {
     PhoImage* img = NewPhoImage("test.jpg");
     AppendItem(img);
     DeleteItem(img);
-    TEST_ASSERT_NULL(gFirstImage);
+    TEST_ASSERT_EQUAL_INT(0, CountImages());
+    TEST_ASSERT_NULL(ImageAt(0));
+}
+
+void test_delete_current_moves_to_next(void) {
+    PhoImage* a = NewPhoImage("a.jpg");
+    PhoImage* b = NewPhoImage("b.jpg");
+    PhoImage* c = NewPhoImage("c.jpg");
+    AppendItem(a); AppendItem(b); AppendItem(c);
+    SetCurrentImage(1);
+    DeleteItem(0);
+    TEST_ASSERT_EQUAL_PTR(c, gCurImage);
+    TEST_ASSERT_EQUAL_INT(2, gCurIndex);
+    TEST_ASSERT_EQUAL_PTR(a, ImageAt(0));
+    TEST_ASSERT_EQUAL_INT(2, CountImages());
+}
+
+void test_append_many_keeps_positions(void) {
+    int i;
+    char name[32];
+    for (i = 0; i < 1000; ++i) {
+        sprintf(name, "img%d.jpg", i);
+        AppendItem(NewPhoImage(name));
+    }
+    TEST_ASSERT_EQUAL_INT(1000, CountImages());
+    TEST_ASSERT_EQUAL_STRING("img0.jpg", ImageAt(0)->filename);
+    TEST_ASSERT_EQUAL_STRING("img999.jpg", ImageAt(999)->filename);
+    TEST_ASSERT_NULL(ImageAt(1000));
+}
+
+void test_clear_reuses_records(void) {
+    PhoImage* first = NewPhoImage("a.jpg");
+    AppendItem(first);
+    ClearImageList();
+    TEST_ASSERT_EQUAL_INT(0, CountImages());
+    /* The slab is rewound, so the next record is the same one, zeroed */
+    TEST_ASSERT_EQUAL_PTR(first, NewPhoImage("b.jpg"));
+    TEST_ASSERT_EQUAL_STRING("b.jpg", first->filename);
+    TEST_ASSERT_NULL(first->comment);
+}
+
+void test_shuffle_is_a_seeded_permutation(void) {
+    static char seen[1000];
+    int i, moved = 0;
+    for (i = 0; i < 1000; ++i)
+        AppendItem(NewPhoImage("test.jpg"));
+    ShuffleImages(42);
+    memset(seen, 0, sizeof seen);
+    for (i = 0; i < 1000; ++i) {
+        int index = PositionToIndex(i);
+        TEST_ASSERT_TRUE(index >= 0 && index < 1000);
+        TEST_ASSERT_FALSE(seen[index]);
+        seen[index] = 1;
+        TEST_ASSERT_EQUAL_INT(i, IndexToPosition(index));
+        if (index != i)
+            ++moved;
+    }
+    TEST_ASSERT_TRUE(moved > 900);
+
+    /* The same seed gives the same order */
+    i = PositionToIndex(0);
+    ShuffleImages(42);
+    TEST_ASSERT_EQUAL_INT(i, PositionToIndex(0));
+
+    /* Images added after shuffling come after the shuffled ones */
+    AppendItem(NewPhoImage("late.jpg"));
+    TEST_ASSERT_EQUAL_INT(1000, PositionToIndex(1000));
+}
+
+void test_restore_item_refills_slot(void) {
+    PhoImage* a = NewPhoImage("a.jpg");
+    PhoImage* b = NewPhoImage("b.jpg");
+    AppendItem(a); AppendItem(b);
+    DeleteItem(a);
+    TEST_ASSERT_EQUAL_INT(1, CountImages());
+    RestoreItem(a, 0);
+    TEST_ASSERT_EQUAL_PTR(a, ImageAt(0));
+    TEST_ASSERT_EQUAL_INT(2, CountImages());
+    /* An occupied slot is left alone */
+    RestoreItem(a, 1);
+    TEST_ASSERT_EQUAL_PTR(b, ImageAt(1));
+}
+
+/* Walk the list the slow way to check LiveRank() and LivePosition() */
+static void check_live_ranks(void) {
+    int pos, rank = 0;
+    for (pos = 0; pos < gNumImages; ++pos) {
+        TEST_ASSERT_EQUAL_INT(rank, LiveRank(pos));
+        if (ImageAtPosition(pos))
+            TEST_ASSERT_EQUAL_INT(pos, LivePosition(rank++));
+    }
+    TEST_ASSERT_EQUAL_INT(CountImages(), rank);
+    TEST_ASSERT_EQUAL_INT(rank, LiveRank(gNumImages));
+    TEST_ASSERT_EQUAL_INT(-1, LivePosition(rank));
+    TEST_ASSERT_EQUAL_INT(-1, LivePosition(-1));
+}
+
+void test_live_ranks_skip_removed_images(void) {
+    PhoImage* removed[100];
+    int i;
+    for (i = 0; i < 300; ++i)
+        AppendItem(NewPhoImage("test.jpg"));
+    for (i = 0; i < 100; ++i) {
+        removed[i] = ImageAt(i * 3);
+        DeleteItem(removed[i]);
+    }
+    check_live_ranks();
+
+    /* Shuffled, restored, and grown past the list's allocation */
+    ShuffleImages(5);
+    check_live_ranks();
+    for (i = 0; i < 100; i += 2)
+        RestoreItem(removed[i], i * 3);
+    check_live_ranks();
+    for (i = 0; i < 300; ++i)
+        AppendItem(NewPhoImage("late.jpg"));
+    DeleteItem(ImageAt(599));
+    check_live_ranks();
+}
+
+void test_filter_steps_through_matches(void) {
+    int i;
+    for (i = 0; i < 6; ++i)
+        AppendItem(NewPhoImage("test.jpg"));
+    SetNote(ImageAt(1), 3, 1);
+    SetNote(ImageAt(4), 3, 1);
+    ImageAt(5)->curRot = 90;
+
+    TEST_ASSERT_EQUAL_INT(2, SetImageFilter("3"));
+    TEST_ASSERT_EQUAL_INT(1, NextPosition(-1));
+    TEST_ASSERT_EQUAL_INT(4, NextPosition(1));
+    TEST_ASSERT_EQUAL_INT(-1, NextPosition(4));
+    TEST_ASSERT_EQUAL_INT(1, PrevPosition(4));
+    TEST_ASSERT_EQUAL_INT(1, FilterRank(4));
+    TEST_ASSERT_EQUAL_INT(-1, FilterRank(2));
+
+    /* Alternatives and negation */
+    TEST_ASSERT_EQUAL_INT(3, SetImageFilter("3, rotated"));
+    TEST_ASSERT_EQUAL_INT(5, NextPosition(4));
+    TEST_ASSERT_EQUAL_INT(3, SetImageFilter("!3 !rotated"));
+    TEST_ASSERT_EQUAL_INT(0, NextPosition(-1));
+
+    /* Bad expressions leave the filter alone */
+    TEST_ASSERT_EQUAL_INT(-1, SetImageFilter("3 blue"));
+    TEST_ASSERT_EQUAL_STRING("!3 !rotated", ImageFilter());
+
+    /* An empty filter shows everything */
+    TEST_ASSERT_EQUAL_INT(6, SetImageFilter(""));
+    TEST_ASSERT_NULL(ImageFilter());
+    TEST_ASSERT_EQUAL_INT(2, NextPosition(1));
+}
+
+void test_filter_follows_changes(void) {
+    int i;
+    for (i = 0; i < 4; ++i)
+        AppendItem(NewPhoImage("test.jpg"));
+    TEST_ASSERT_EQUAL_INT(0, SetImageFilter("2"));
+
+    SetNote(ImageAt(2), 2, 1);
+    FilterImageChanged(ImageAt(2));
+    TEST_ASSERT_EQUAL_INT(2, NextPosition(-1));
+
+    /* New images are checked as they're appended */
+    AppendItem(NewPhoImage("new.jpg"));
+    SetNote(ImageAt(4), 2, 1);
+    FilterImageChanged(ImageAt(4));
+    TEST_ASSERT_EQUAL_INT(2, FilterCount());
+
+    /* Deleting the current image moves to the next match */
+    SetCurrentImage(2);
+    DeleteItem(0);
+    TEST_ASSERT_EQUAL_INT(4, gCurIndex);
+    TEST_ASSERT_EQUAL_INT(1, FilterCount());
+
+    /* The view survives a shuffle */
+    ShuffleImages(7);
+    TEST_ASSERT_EQUAL_INT(4, PositionToIndex(NextPosition(-1)));
+}
+
+void test_notes_past_bit_63(void) {
+    const int* indices;
+    int i, count;
+    for (i = 0; i < 3; ++i)
+        AppendItem(NewPhoImage("test.jpg"));
+    SetNote(ImageAt(2), 200, 1);
+    SetNote(ImageAt(0), 200, 1);
+    SetNote(ImageAt(1), 63, 1);
+    TEST_ASSERT_TRUE(HasNote(ImageAt(2), 200));
+    TEST_ASSERT_FALSE(HasNote(ImageAt(1), 200));
+    TEST_ASSERT_FALSE(HasNote(ImageAt(1), 199));
+    TEST_ASSERT_TRUE(HasNote(ImageAt(1), 63));
+
+    /* The index lists images in list order, and skips removed ones */
+    indices = NoteImages(200, &count);
+    TEST_ASSERT_EQUAL_INT(2, count);
+    TEST_ASSERT_EQUAL_INT(0, indices[0]);
+    TEST_ASSERT_EQUAL_INT(2, indices[1]);
+    DeleteItem(ImageAt(0));
+    TEST_ASSERT_EQUAL_INT(1, NoteCount(200));
+
+    SetNote(ImageAt(2), 200, 0);
+    TEST_ASSERT_EQUAL_INT(0, NoteCount(200));
+    TEST_ASSERT_EQUAL_INT(1, SetImageFilter("63"));
 }
 
 int main(void) {
     UNITY_BEGIN();
     RUN_TEST(test_append_item_to_empty_list);
     RUN_TEST(test_delete_only_item);
+    RUN_TEST(test_delete_current_moves_to_next);
+    RUN_TEST(test_append_many_keeps_positions);
+    RUN_TEST(test_clear_reuses_records);
+    RUN_TEST(test_shuffle_is_a_seeded_permutation);
+    RUN_TEST(test_restore_item_refills_slot);
+    RUN_TEST(test_live_ranks_skip_removed_images);
+    RUN_TEST(test_filter_steps_through_matches);
+    RUN_TEST(test_filter_follows_changes);
+    RUN_TEST(test_notes_past_bit_63);
     return UNITY_END();
 }
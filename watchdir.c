@@ -0,0 +1,457 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * watchdir.c: add images to the list as they appear in a directory,
+ * e.g. when shooting tethered.
+ *
+ * Copyright 2010 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+/* pho --watch dir shows the images already in dir, then uses inotify
+ * to notice new ones: a file counts as new when it's closed after
+ * writing (IN_CLOSE_WRITE) or renamed into the directory (IN_MOVED_TO),
+ * so half-written files are never picked up.
+ *
+ * Each new image is appended to the image list and decoded right away
+ * in a background thread, scaled for the screen if the scale mode
+ * allows working that out ahead of time, and kept until the image is
+ * shown. There's one decoding thread, and only the newest image is
+ * kept, so when a burst of files arrives, any still waiting to be
+ * decoded when a newer one comes are skipped. With --follow, pho
+ * also jumps to each new image as soon as it's decoded.
+ *
+ * Files already there, or that arrive while the directory is still
+ * being read, may show up in both the scan and the inotify events,
+ * so new files are checked against what the scan added, and waited
+ * on until it's done.
+ *
+ * Slideshows use the same prefetching, with a slot of their own, to
+ * decode and scale the next slide while the current one is on the
+ * screen, so the cut doesn't wait for either.
+ */
+
+#include "pho.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+/* Jump to each new image as it arrives? */
+int gWatchFollow = 0;
+
+/* What's been decoded ahead of time: the newest arrival in the watched
+ * directory, and separately the next slide, so that arrivals don't
+ * push it out. The filename is kept too, since the PhoImage record
+ * may be reused after ClearImageList().
+ */
+typedef struct {
+    PhoImage* img;
+    char* name;
+    GdkPixbuf* pixbuf;
+    int trueWidth, trueHeight;  /* the image's own size */
+    int generation;             /* of the newest job for this slot */
+} PrefetchSlot;
+
+static PrefetchSlot sArrival, sNextSlide;
+
+typedef struct {
+    PrefetchSlot* slot;
+    PhoImage* img;
+    int index;
+    char* filename;
+    GdkPixbuf* pixbuf;
+    int trueWidth, trueHeight;
+    int follow;         /* jump to it once it's decoded */
+    int generation;     /* it's been superseded if this isn't current */
+
+    /* What to scale it for, as ScaleAndRotate would; fitWidth is 0
+     * if it can't be worked out ahead of time.
+     */
+    int fitWidth, fitHeight;
+    int scaleMode;
+    double scaleRatio;
+    int scaleFactor;
+    int rot;            /* -1 to go by its EXIF orientation */
+} PrefetchJob;
+
+static GThreadPool* sPrefetchPool = 0;
+
+static void DropPrefetchedImage(PrefetchSlot* slot)
+{
+    if (slot->pixbuf)
+        g_object_unref(slot->pixbuf);
+    g_free(slot->name);
+    slot->img = 0;
+    slot->name = 0;
+    slot->pixbuf = 0;
+}
+
+static int IsPrefetched(PrefetchSlot* slot, PhoImage* img)
+{
+    return img && img == slot->img && !strcmp(img->filename, slot->name);
+}
+
+/* If img was decoded ahead of time, return its pixbuf (which the caller
+ * now owns), else 0. The pixbuf may have been scaled already, so the
+ * image's own size goes in *trueWidth and *trueHeight.
+ */
+GdkPixbuf* TakePrefetchedImage(PhoImage* img, int* trueWidth,
+                               int* trueHeight)
+{
+    PrefetchSlot* slot;
+    GdkPixbuf* pixbuf;
+
+    if (IsPrefetched(&sNextSlide, img))
+        slot = &sNextSlide;
+    else if (IsPrefetched(&sArrival, img))
+        slot = &sArrival;
+    else
+        return 0;
+
+    pixbuf = slot->pixbuf;
+    *trueWidth = slot->trueWidth;
+    *trueHeight = slot->trueHeight;
+    slot->pixbuf = 0;
+    DropPrefetchedImage(slot);
+    return pixbuf;
+}
+
+/* Back in the main thread with a decoded image */
+static gboolean PrefetchDone(gpointer data)
+{
+    PrefetchJob* job = data;
+    PrefetchSlot* slot = job->slot;
+
+    if (job->pixbuf && ImageAt(job->index) == job->img
+        && !strcmp(job->img->filename, job->filename)) {
+        DropPrefetchedImage(slot);
+        slot->img = job->img;
+        slot->name = job->filename;
+        slot->pixbuf = job->pixbuf;
+        slot->trueWidth = job->trueWidth;
+        slot->trueHeight = job->trueHeight;
+        job->filename = 0;
+        job->pixbuf = 0;
+
+        if (gDebug)
+            printf("Prefetched %s at %dx%d\n", slot->name,
+                   gdk_pixbuf_get_width(slot->pixbuf),
+                   gdk_pixbuf_get_height(slot->pixbuf));
+        if (job->follow)
+            GotoImage(IndexToPosition(job->index));
+    }
+
+    if (job->pixbuf)
+        g_object_unref(job->pixbuf);
+    g_free(job->filename);
+    g_free(job);
+    return FALSE;
+}
+
+/* In the worker thread: scale job->pixbuf down to what ScaleAndRotate
+ * would, so that showing it doesn't have to.
+ */
+static void ScalePrefetched(PrefetchJob* job)
+{
+    int s = job->scaleFactor;
+    int w = (job->trueWidth + s - 1) / s;
+    int h = (job->trueHeight + s - 1) / s;
+    int maxw = job->fitWidth, maxh = job->fitHeight;
+    int rot = job->rot;
+    GdkPixbuf* scaled;
+
+    if (rot < 0) {
+        const char* orientation = gdk_pixbuf_get_option(job->pixbuf,
+                                                        "orientation");
+        rot = (orientation && (!strcmp(orientation, "6")
+                               || !strcmp(orientation, "8"))) ? 90 : 0;
+    }
+    /* It's scaled before it's rotated */
+    if (rot % 180 != 0) {
+        maxw = job->fitHeight;
+        maxh = job->fitWidth;
+    }
+    if (w <= maxw && h <= maxh)
+        return;
+
+    ScaleToFit(&w, &h, maxw, maxh, job->scaleMode, job->scaleRatio);
+    scaled = gdk_pixbuf_scale_simple(job->pixbuf, w * s, h * s,
+                                     GDK_INTERP_BILINEAR);
+    if (scaled && gdk_pixbuf_get_width(scaled) > 0) {
+        g_object_unref(job->pixbuf);
+        job->pixbuf = scaled;
+    }
+    else if (scaled)
+        g_object_unref(scaled);
+}
+
+static void PrefetchWorker(gpointer data, gpointer user_data)
+{
+    PrefetchJob* job = data;
+
+    /* Don't decode what would only be thrown away */
+    if (job->generation != g_atomic_int_get(&job->slot->generation))
+        job->follow = 0;
+    else if ((job->pixbuf = gdk_pixbuf_new_from_file(job->filename, 0))) {
+        job->trueWidth = gdk_pixbuf_get_width(job->pixbuf);
+        job->trueHeight = gdk_pixbuf_get_height(job->pixbuf);
+        if (job->fitWidth > 0)
+            ScalePrefetched(job);
+    }
+    g_idle_add(PrefetchDone, job);
+}
+
+static void Prefetch(PrefetchSlot* slot, int index, int follow)
+{
+    PrefetchJob* job;
+    PhoImage* img = ImageAt(index);
+
+    if (!img || IsPrefetched(slot, img))
+        return;
+
+    job = g_new0(PrefetchJob, 1);
+    job->slot = slot;
+    job->img = img;
+    job->index = index;
+    job->filename = g_strdup(img->filename);
+    job->follow = follow;
+    job->generation = g_atomic_int_add(&slot->generation, 1) + 1;
+
+    /* The scale modes that fit the image to the screen can be worked
+     * out without the main thread; the others are left to it.
+     */
+    if (gScaleMode == PHO_SCALE_NORMAL
+        || gScaleMode == PHO_SCALE_SCREEN_RATIO
+        || (gScaleMode == PHO_SCALE_FIXED && gScaleRatio > 0)) {
+        job->fitWidth = gMonitorWidth;
+        job->fitHeight = gMonitorHeight;
+        job->scaleMode = gScaleMode;
+        job->scaleRatio = gScaleRatio;
+        job->scaleFactor = gScaleFactor;
+        if (img->trueWidth > 0 || JournalHasRotation(img)
+            || XmpHasRotation(img))
+            job->rot = img->curRot;
+        else
+            job->rot = -1;
+    }
+
+    if (!sPrefetchPool)
+        sPrefetchPool = g_thread_pool_new(PrefetchWorker, 0, 1, FALSE, 0);
+    g_thread_pool_push(sPrefetchPool, job, 0);
+}
+
+/* Start decoding and scaling the image at index in the background,
+ * so that showing it as the next slide doesn't have to wait.
+ */
+void PrefetchImage(int index)
+{
+    Prefetch(&sNextSlide, index, 0);
+}
+
+#ifdef __linux__
+
+static char* sWatchDir = 0;
+static int sWatchDirFd = -1;
+static int sInotifyFd = -1;
+
+/* Names already added, so rewriting a file doesn't add it again,
+ * and how much of the image list has been put in it.
+ */
+static GHashTable* sWatchSeen = 0;
+static int sWatchSeenUpTo = 0;
+
+/* Files that arrived while the directory was still being read */
+static GPtrArray* sWatchWaiting = 0;
+static guint sWatchWaitTimer = 0;
+
+/* How often to check whether the directory has been read */
+#define WATCH_WAIT_MILLIS 100
+
+/* Remember the files in the watched directory that have been added
+ * to the list since last time, however they got there.
+ */
+static void UpdateWatchSeen()
+{
+    size_t len = strlen(sWatchDir);
+
+    if (sWatchSeenUpTo > gNumImages)    /* the list was replaced */
+        sWatchSeenUpTo = 0;
+    for ( ; sWatchSeenUpTo < gNumImages; ++sWatchSeenUpTo) {
+        PhoImage* img = ImageAt(sWatchSeenUpTo);
+        if (img && !strncmp(img->filename, sWatchDir, len))
+            g_hash_table_add(sWatchSeen, g_strdup(img->filename));
+    }
+}
+
+/* Add a file that's arrived, unless it's been added already.
+ * Takes ownership of path.
+ */
+static void AddWatchedPath(char* path)
+{
+    UpdateWatchSeen();
+    if (g_hash_table_contains(sWatchSeen, path)) {
+        g_free(path);
+        return;
+    }
+
+    if (gDebug)
+        printf("New image in watched directory: %s\n", path);
+    AddImage(path);
+    UpdateWatchSeen();
+    g_free(path);
+    Prefetch(&sArrival, gNumImages - 1, gWatchFollow);
+}
+
+static gboolean WatchWaitTimer(gpointer data)
+{
+    guint i;
+
+    if (DirScansPending())
+        return TRUE;
+    sWatchWaitTimer = 0;
+    for (i = 0; i < sWatchWaiting->len; ++i)
+        AddWatchedPath(g_ptr_array_index(sWatchWaiting, i));
+    g_ptr_array_set_size(sWatchWaiting, 0);
+    return FALSE;
+}
+
+static void AddWatchedFile(const char* name)
+{
+    char* path;
+
+    /* Skip hidden files, e.g. temporaries that get renamed when done */
+    if (name[0] == '.' || !IsImageFile(sWatchDirFd, name))
+        return;
+
+    path = g_build_filename(sWatchDir, name, NULL);
+
+    /* The scan may be about to add it too */
+    if (DirScansPending() || sWatchWaitTimer) {
+        g_ptr_array_add(sWatchWaiting, path);
+        if (!sWatchWaitTimer)
+            sWatchWaitTimer = g_timeout_add(WATCH_WAIT_MILLIS,
+                                            WatchWaitTimer, 0);
+        return;
+    }
+    AddWatchedPath(path);
+}
+
+/* Handle whatever inotify events are waiting.
+ * Returns 0 if the watch has stopped working, else 1.
+ */
+static int ReadWatchEvents()
+{
+    char buf[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event* event;
+    ssize_t len;
+    char* ptr;
+
+    len = read(sInotifyFd, buf, sizeof buf);
+    if (len < 0 && (errno == EAGAIN || errno == EINTR))
+        return 1;
+    if (len <= 0) {
+        perror("Watching directory");
+        return 0;
+    }
+
+    for (ptr = buf; ptr < buf + len; ptr += sizeof *event + event->len) {
+        event = (const struct inotify_event*)ptr;
+        if (event->mask & IN_Q_OVERFLOW)
+            fprintf(stderr, "Too many new files at once; some were missed\n");
+        if (event->mask & IN_IGNORED) {
+            fprintf(stderr, "%s went away; not watching it any more\n",
+                    sWatchDir);
+            return 0;
+        }
+        if (event->len > 0 && (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)))
+            AddWatchedFile(event->name);
+    }
+    return 1;
+}
+
+static gboolean WatchReadable(GIOChannel* source, GIOCondition condition,
+                              gpointer data)
+{
+    return ReadWatchEvents() ? TRUE : FALSE;
+}
+
+/* Show the images in dirname, and add new ones as they show up. */
+void WatchDirectory(const char* dirname)
+{
+    GIOChannel* channel;
+
+    if (sInotifyFd >= 0) {
+        fprintf(stderr, "Only one --watch directory allowed\n");
+        Usage();
+    }
+
+    InitImageTypes();
+    sWatchDir = g_strdup(dirname);
+    sWatchSeen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, 0);
+    sWatchWaiting = g_ptr_array_new();
+
+    sWatchDirFd = open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    sInotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (sWatchDirFd < 0 || sInotifyFd < 0
+        || inotify_add_watch(sInotifyFd, dirname,
+                             IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR) < 0) {
+        perror(dirname);
+        exit(1);
+    }
+
+    /* Start watching before reading what's there, so nothing is missed */
+    channel = g_io_channel_unix_new(sInotifyFd);
+    g_io_add_watch(channel, G_IO_IN, WatchReadable, 0);
+    g_io_channel_unref(channel);
+
+    AddDirectory(dirname);
+}
+
+/* Wait until a new image arrives in the watched directory, if any.
+ * Returns 0 if there's no directory being watched.
+ */
+int WaitForWatchedImage()
+{
+    struct pollfd pfd;
+
+    if (sInotifyFd < 0)
+        return 0;
+
+    /* So that new files don't wait on the scan */
+    WaitForDirScans(1);
+
+    printf("Waiting for images in %s ...\n", sWatchDir);
+    pfd.fd = sInotifyFd;
+    pfd.events = POLLIN;
+    while (CountImages() == 0) {
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            return 0;
+        if (!ReadWatchEvents())
+            return 0;
+    }
+    return 1;
+}
+
+#else /* __linux__ */
+
+void WatchDirectory(const char* dirname)
+{
+    fprintf(stderr, "Sorry, --watch needs inotify, which only Linux has.\n");
+    exit(1);
+}
+
+int WaitForWatchedImage()
+{
+    return 0;
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,882 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * xmp.c: keeping notes, captions and rotation in XMP sidecar files.
+ *
+ * Copyright 2010 by Akkana Peck.
+ * You are free to use or modify this code under the Gnu Public License.
+ */
+
+/* With --xmp, each image gets a sidecar, image.jpg.xmp, holding
+ *   dc:subject      the keywords of its notes that have keywords
+ *   dc:description  its caption
+ *   tiff:Orientation its rotation
+ *   pho:notes       its note numbers, so notes without keywords
+ *                   survive a round trip too
+ * which photo managers can import. When pho rewrites a sidecar,
+ * everything else in it is written back as it was: other properties,
+ * whether attributes or elements, their namespaces, and keywords from
+ * other programs (ones that aren't in the keywords dialog). A sidecar
+ * pho can't read, or couldn't write back without losing something,
+ * is never written over.
+ * tiff:Orientation is only written once pho knows the rotation: once
+ * the image has been loaded, or if the journal or sidecar said.
+ *
+ * An image whose notes, caption or rotation change is marked dirty,
+ * and its sidecar is written when pho moves on to another image (or
+ * at exit), by a worker thread, so tagging never waits for the disk.
+ * Changes to images that aren't being shown (from the keywords dialog
+ * or the journal) are gathered up and written together once they're
+ * done. A sidecar is never written before it's been read: the write
+ * waits for the read, so what other programs put there isn't lost.
+ *
+ * The first time an image is shown, its sidecar is read, by the same
+ * worker, along with the sidecars for the next XMP_READAHEAD images.
+ * What's read only adds to what pho already knows: notes are turned
+ * on, never off, and a caption or rotation is only taken if the image
+ * doesn't have one yet. Keywords in dc:subject turn on the notes that
+ * have those keywords in the keywords dialog.
+ */
+
+#include "pho.h"
+#include "dialogs.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* How many images ahead to read sidecars for */
+#define XMP_READAHEAD 4
+
+/* Read and write XMP sidecars? */
+int gUseXmp = 0;
+
+typedef enum {
+    XMP_PENDING,
+    XMP_NONE,
+    XMP_READ,
+    XMP_BAD             /* can't be read, so it's never written over */
+} XmpState;
+
+/* What a sidecar said */
+typedef struct {
+    XmpState state;
+    int writeWanted;    /* write the image's sidecar once it's read */
+    NoteSet notes;
+    GPtrArray* subjects;
+    int haveRot;
+    int rot;
+    char* caption;
+
+    /* What pho doesn't manage, to write back as it was */
+    char* about;            /* rdf:about */
+    GString* otherAttrs;    /* attributes of rdf:Description */
+    GString* otherProps;    /* its other properties, as XML */
+} XmpInfo;
+
+/* Where the parser has got to in a sidecar */
+typedef struct {
+    XmpInfo* xi;
+    int otherDepth;     /* depth inside a property that isn't pho's */
+    int phoDepth;       /* depth inside one of pho's properties */
+    int captions;       /* dc:description items */
+} XmpReader;
+
+typedef struct {
+    PhoImage* img;
+    int index;
+    char* filename;     /* the image's, to check the slot wasn't reused */
+    char* path;         /* the sidecar */
+    char* text;         /* what to write, or 0 to read */
+    XmpInfo* pending;   /* what's in sXmpInfo while it's being read */
+    XmpInfo* info;      /* what was read */
+} XmpJob;
+
+/* image filename -> XmpInfo */
+static GHashTable* sXmpInfo = 0;
+
+/* Reads and writes share one thread, so a read after a write
+ * always sees what was written.
+ */
+static GThreadPool* sXmpPool = 0;
+static int sXmpReadsPending = 0;
+
+/* Reads the worker has finished, for the main thread to take in */
+static GAsyncQueue* sXmpReadsDone = 0;
+
+/* Don't count what we read from a sidecar as a change */
+static int sApplying = 0;
+
+/* Indices of images changed while not being shown, to write together */
+static GArray* sXmpLeftImages = 0;
+static guint sXmpFlushIdle = 0;
+
+static void WriteXmp(PhoImage* img);    /* forward */
+
+static void FreeXmpInfo(gpointer data)
+{
+    XmpInfo* xi = data;
+    if (xi->subjects)
+        g_ptr_array_free(xi->subjects, TRUE);
+    g_free(xi->caption);
+    g_free(xi->about);
+    if (xi->otherAttrs)
+        g_string_free(xi->otherAttrs, TRUE);
+    if (xi->otherProps)
+        g_string_free(xi->otherProps, TRUE);
+    g_free(xi);
+}
+
+static void FreeXmpJob(XmpJob* job)
+{
+    g_free(job->filename);
+    g_free(job->path);
+    g_free(job->text);
+    if (job->info)
+        FreeXmpInfo(job->info);
+    g_free(job);
+}
+
+static char* XmpName(PhoImage* img)
+{
+    return g_strdup_printf("%s.xmp", img->filename);
+}
+
+/* EXIF/TIFF orientations for 0, 90, 180 and 270 degrees */
+static int RotToOrientation(int rot)
+{
+    switch ((rot + 360) % 360)
+    {
+      case 90:  return 6;
+      case 180: return 3;
+      case 270: return 8;
+      default:  return 1;
+    }
+}
+
+static int OrientationToRot(int orientation)
+{
+    switch (orientation)
+    {
+      case 1:  return 0;
+      case 6:  return 90;
+      case 3:  return 180;
+      case 8:  return 270;
+      default: return -1;
+    }
+}
+
+static void SetInfoRotation(XmpInfo* xi, const char* orientation)
+{
+    int rot = OrientationToRot(atoi(orientation));
+    if (rot >= 0) {
+        xi->haveRot = 1;
+        xi->rot = rot;
+    }
+}
+
+/*************************************
+ * Reading, in the worker thread
+ */
+
+/* The namespaces pho writes, which a sidecar mustn't use otherwise */
+static const char* sXmpNamespaces[][2] = {
+    { "xmlns:x", "adobe:ns:meta/" },
+    { "xmlns:rdf", "http://www.w3.org/1999/02/22-rdf-syntax-ns#" },
+    { "xmlns:dc", "http://purl.org/dc/elements/1.1/" },
+    { "xmlns:tiff", "http://ns.adobe.com/tiff/1.0/" },
+    { "xmlns:pho", "http://shallowsky.com/software/pho/ns/1.0/" }
+};
+
+/* The properties pho writes */
+static int IsPhoProperty(const char* name)
+{
+    return !strcmp(name, "dc:subject") || !strcmp(name, "dc:description")
+        || !strcmp(name, "tiff:Orientation") || !strcmp(name, "pho:notes");
+}
+
+static void CantRewrite(GError** error, const char* what)
+{
+    g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                "pho can't rewrite %s", what);
+}
+
+static void AppendAttribute(GString* str, const char* sep,
+                            const char* name, const char* value)
+{
+    char* esc = g_markup_escape_text(value, -1);
+    g_string_append_printf(str, "%s%s=\"%s\"", sep, name, esc);
+    g_free(esc);
+}
+
+/* Keep an attribute of rdf:Description (or a namespace declared
+ * further out) to write back. Returns 0 if it can't be.
+ */
+static int KeepAttribute(XmpInfo* xi, const char* name, const char* value,
+                         GError** error)
+{
+    GString* attr;
+    char* key;
+    int i, ok = 1;
+
+    if (g_str_has_prefix(name, "xmlns:"))
+        for (i = 0; i < G_N_ELEMENTS(sXmpNamespaces); ++i) {
+            int prefix = !strcmp(name, sXmpNamespaces[i][0]);
+            int uri = !strcmp(value, sXmpNamespaces[i][1]);
+            if (prefix && uri)
+                return 1;
+            if (prefix || uri) {
+                CantRewrite(error, "another use of pho's namespaces");
+                return 0;
+            }
+        }
+    else if (IsPhoProperty(name)) {
+        CantRewrite(error, name);
+        return 0;
+    }
+
+    /* Several rdf:Descriptions may declare the same namespace,
+     * but can't give anything two different values.
+     */
+    if (!xi->otherAttrs)
+        xi->otherAttrs = g_string_new("");
+    attr = g_string_new("");
+    AppendAttribute(attr, "\n    ", name, value);
+    key = g_strdup_printf("\n    %s=\"", name);
+    if (!strstr(xi->otherAttrs->str, attr->str)) {
+        if (strstr(xi->otherAttrs->str, key)) {
+            CantRewrite(error, name);
+            ok = 0;
+        }
+        else
+            g_string_append(xi->otherAttrs, attr->str);
+    }
+    g_free(key);
+    g_string_free(attr, TRUE);
+    return ok;
+}
+
+static void XmpStartElement(GMarkupParseContext* context,
+                            const gchar* element,
+                            const gchar** attr_names,
+                            const gchar** attr_values,
+                            gpointer user_data, GError** error)
+{
+    XmpReader* reader = user_data;
+    XmpInfo* xi = reader->xi;
+    const GSList* stack = g_markup_parse_context_get_element_stack(context);
+    const char* parent = (stack->next ? stack->next->data : "");
+    int i;
+
+    /* Other programs' properties are kept as they are */
+    if (reader->otherDepth > 0
+        || (!strcmp(parent, "rdf:Description") && !IsPhoProperty(element))) {
+        if (!xi->otherProps)
+            xi->otherProps = g_string_new("");
+        g_string_append_printf(xi->otherProps, "%s<%s",
+                               reader->otherDepth ? "" : "   ", element);
+        for (i = 0; attr_names[i]; ++i)
+            AppendAttribute(xi->otherProps, " ",
+                            attr_names[i], attr_values[i]);
+        g_string_append_c(xi->otherProps, '>');
+        ++reader->otherDepth;
+        return;
+    }
+
+    if (reader->phoDepth > 0 || !strcmp(parent, "rdf:Description")) {
+        ++reader->phoDepth;
+        /* Only one caption can be written back */
+        if (!strcmp(element, "rdf:li") && stack->next->next
+            && !strcmp(stack->next->next->data, "dc:description")
+            && ++reader->captions > 1)
+            CantRewrite(error, "captions in more than one language");
+        return;
+    }
+
+    if ((!strcmp(element, "x:xmpmeta") && !*parent)
+        || (!strcmp(element, "rdf:RDF")
+            && (!*parent || !strcmp(parent, "x:xmpmeta")))) {
+        /* Namespaces declared out here are moved in */
+        for (i = 0; attr_names[i]; ++i)
+            if (g_str_has_prefix(attr_names[i], "xmlns")
+                && !KeepAttribute(xi, attr_names[i], attr_values[i], error))
+                return;
+        return;
+    }
+
+    if (strcmp(element, "rdf:Description") || strcmp(parent, "rdf:RDF")) {
+        CantRewrite(error, element);
+        return;
+    }
+
+    /* Properties may be attributes of rdf:Description */
+    for (i = 0; attr_names[i]; ++i) {
+        if (!strcmp(attr_names[i], "tiff:Orientation"))
+            SetInfoRotation(xi, attr_values[i]);
+        else if (!strcmp(attr_names[i], "rdf:about")) {
+            if (!xi->about)
+                xi->about = g_strdup(attr_values[i]);
+            else if (strcmp(xi->about, attr_values[i])) {
+                CantRewrite(error, "more than one rdf:about");
+                return;
+            }
+        }
+        else if (!KeepAttribute(xi, attr_names[i], attr_values[i], error))
+            return;
+    }
+}
+
+static void XmpEndElement(GMarkupParseContext* context,
+                          const gchar* element,
+                          gpointer user_data, GError** error)
+{
+    XmpReader* reader = user_data;
+
+    if (reader->otherDepth > 0) {
+        g_string_append_printf(reader->xi->otherProps, "</%s>", element);
+        if (--reader->otherDepth == 0)
+            g_string_append_c(reader->xi->otherProps, '\n');
+    }
+    else if (reader->phoDepth > 0)
+        --reader->phoDepth;
+}
+
+static void XmpText(GMarkupParseContext* context,
+                    const gchar* text, gsize len,
+                    gpointer user_data, GError** error)
+{
+    XmpReader* reader = user_data;
+    XmpInfo* xi = reader->xi;
+    const GSList* stack = g_markup_parse_context_get_element_stack(context);
+    const char* element = stack->data;
+    const char* property;
+    char* str;
+
+    if (reader->otherDepth > 0) {
+        str = g_markup_escape_text(text, len);
+        g_string_append(xi->otherProps, str);
+        g_free(str);
+        return;
+    }
+
+    /* or elements of their own */
+    if (!strcmp(element, "tiff:Orientation")) {
+        str = g_strndup(text, len);
+        SetInfoRotation(xi, str);
+        g_free(str);
+        return;
+    }
+
+    /* Lists are property > rdf:Bag or rdf:Alt > rdf:li */
+    if (strcmp(element, "rdf:li") || !stack->next || !stack->next->next)
+        return;
+    property = stack->next->next->data;
+    str = g_strstrip(g_strndup(text, len));
+
+    if (!strcmp(property, "pho:notes")) {
+        int note = atoi(str);
+        if (note >= 0 && note < NUM_NOTES)
+            xi->notes.words[note / NOTE_WORD_BITS]
+                |= (guint64)1 << (note % NOTE_WORD_BITS);
+    }
+    else if (!strcmp(property, "dc:subject") && *str) {
+        if (!xi->subjects)
+            xi->subjects = g_ptr_array_new_with_free_func(g_free);
+        g_ptr_array_add(xi->subjects, str);
+        return;
+    }
+    else if (!strcmp(property, "dc:description") && !xi->caption) {
+        xi->caption = str;
+        return;
+    }
+    g_free(str);
+}
+
+/* Comments inside other programs' properties are kept too */
+static void XmpPassthrough(GMarkupParseContext* context,
+                           const gchar* text, gsize len,
+                           gpointer user_data, GError** error)
+{
+    XmpReader* reader = user_data;
+
+    if (reader->otherDepth > 0)
+        g_string_append_len(reader->xi->otherProps, text, len);
+}
+
+static const GMarkupParser sXmpParser = {
+    XmpStartElement, XmpEndElement, XmpText, XmpPassthrough, 0
+};
+
+static void ReadXmpFile(XmpJob* job)
+{
+    GMarkupParseContext* context;
+    XmpReader reader = { 0 };
+    char* text;
+    gsize len;
+    GError* err = 0;
+
+    job->info = g_new0(XmpInfo, 1);
+    if (!g_file_get_contents(job->path, &text, &len, &err)) {
+        /* Only a sidecar that isn't there can be written from scratch */
+        if (g_error_matches(err, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+            job->info->state = XMP_NONE;
+        else {
+            fprintf(stderr, "%s\n", err->message);
+            job->info->state = XMP_BAD;
+        }
+        g_error_free(err);
+        return;
+    }
+
+    job->info->state = XMP_READ;
+    reader.xi = job->info;
+    context = g_markup_parse_context_new(&sXmpParser, 0, &reader, 0);
+    if (!g_markup_parse_context_parse(context, text, len, &err)
+        || !g_markup_parse_context_end_parse(context, &err)) {
+        fprintf(stderr, "%s: %s; leaving it as it is\n",
+                job->path, err->message);
+        g_error_free(err);
+        job->info->state = XMP_BAD;
+    }
+    g_markup_parse_context_free(context);
+    g_free(text);
+}
+
+/*************************************
+ * Back in the main thread
+ */
+
+/* Add what a sidecar said to what we know about img.
+ * shown says whether img is already on the screen.
+ */
+static void ApplyXmp(PhoImage* img, XmpInfo* xi, int shown)
+{
+    int note, i;
+
+    if (xi->state != XMP_READ)
+        return;
+
+    sApplying = 1;
+    for (note = 0; note < NUM_NOTES; ++note) {
+        int on = (xi->notes.words[note / NOTE_WORD_BITS]
+                  & ((guint64)1 << (note % NOTE_WORD_BITS))) != 0;
+
+        /* Keywords only mean something if the dialog has them */
+        if (!on && xi->subjects) {
+            char* keyword = KeywordString(note);
+            for (i = 0; keyword && *keyword && i < (int)xi->subjects->len; ++i)
+                if (!strcmp(keyword, g_ptr_array_index(xi->subjects, i))) {
+                    on = 1;
+                    break;
+                }
+        }
+        if (on && !HasNote(img, note)) {
+            SetNote(img, note, 1);
+            if (img == gCurImage) {
+                SetInfoDialogToggle(note, 1);
+                SetKeywordsDialogToggle(note, 1);
+            }
+        }
+    }
+
+    if (xi->caption && !img->caption) {
+        img->caption = PoolString(xi->caption);
+        if (img == gCurImage)
+            ShowKeywordsCaption(img);
+    }
+
+    /* Until it's loaded, nothing but the journal can have rotated it */
+    if (xi->haveRot && !JournalHasRotation(img)
+        && (img->trueWidth == 0 || !img->xmpDirty)
+        && xi->rot != img->curRot) {
+        if (shown)
+            ScaleAndRotate(img, xi->rot - img->curRot);
+        else
+            img->curRot = xi->rot;
+    }
+    sApplying = 0;
+
+    FilterImageChanged(img);
+}
+
+static void XmpReadDone(XmpJob* job)
+{
+    int writeWanted = job->pending->writeWanted;
+    int same;
+
+    --sXmpReadsPending;
+    if (gDebug)
+        printf("%s XMP sidecar %s\n",
+               job->info->state == XMP_READ ? "Read"
+               : job->info->state == XMP_BAD ? "Unreadable" : "No",
+               job->path);
+
+    same = (ImageAt(job->index) == job->img
+            && !strcmp(job->img->filename, job->filename));
+    if (same)
+        ApplyXmp(job->img, job->info,
+                 job->img == gCurImage && job->img->trueWidth > 0);
+
+    /* Keep it, for if the image is loaded again (this frees pending) */
+    g_hash_table_replace(sXmpInfo, g_strdup(job->filename), job->info);
+    job->info = 0;
+
+    /* A write that was waiting for this can go ahead now */
+    if (same && writeWanted && job->img->xmpDirty && job->img != gCurImage)
+        WriteXmp(job->img);
+
+    FreeXmpJob(job);
+}
+
+/* Take in whatever reads the worker has finished */
+static gboolean TakeXmpReads(gpointer data)
+{
+    XmpJob* job;
+
+    while ((job = g_async_queue_try_pop(sXmpReadsDone)) != 0)
+        XmpReadDone(job);
+    return FALSE;
+}
+
+static void XmpWorker(gpointer data, gpointer user_data)
+{
+    XmpJob* job = data;
+
+    if (job->text) {
+        if (WriteFileAtomically(job->path, job->text) < 0)
+            perror(job->path);
+        else if (gDebug)
+            printf("Wrote XMP sidecar %s\n", job->path);
+        FreeXmpJob(job);
+        return;
+    }
+
+    ReadXmpFile(job);
+    g_async_queue_push(sXmpReadsDone, job);
+    g_idle_add(TakeXmpReads, 0);
+}
+
+static void QueueXmpJob(XmpJob* job)
+{
+    if (!sXmpPool) {
+        if (!sXmpReadsDone)
+            sXmpReadsDone = g_async_queue_new();
+        sXmpPool = g_thread_pool_new(XmpWorker, 0, 1, FALSE, 0);
+    }
+    g_thread_pool_push(sXmpPool, job, 0);
+}
+
+/* Start reading the sidecar for the image at index, if we haven't.
+ * Returns what's known about it so far, or 0.
+ */
+static XmpInfo* RequestXmp(int index)
+{
+    PhoImage* img = ImageAt(index);
+    XmpInfo* xi;
+    XmpJob* job;
+
+    if (!img)
+        return 0;
+    if (!sXmpInfo)
+        sXmpInfo = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                         g_free, FreeXmpInfo);
+    if ((xi = g_hash_table_lookup(sXmpInfo, img->filename)) != 0)
+        return xi;
+
+    xi = g_new0(XmpInfo, 1);
+    xi->state = XMP_PENDING;
+    g_hash_table_insert(sXmpInfo, g_strdup(img->filename), xi);
+
+    job = g_new0(XmpJob, 1);
+    job->img = img;
+    job->index = index;
+    job->filename = g_strdup(img->filename);
+    job->path = XmpName(img);
+    job->pending = xi;
+    ++sXmpReadsPending;
+    QueueXmpJob(job);
+    return xi;
+}
+
+/* img is about to be shown for the first time: take what its sidecar
+ * says if that's been read, else start reading it. Either way, start
+ * on the sidecars for the next few images.
+ */
+void LoadXmp(PhoImage* img)
+{
+    int index, pos, i;
+    XmpInfo* xi;
+
+    if (!gUseXmp || (index = IndexOfImage(img)) < 0)
+        return;
+
+    xi = RequestXmp(index);
+    if (xi)
+        ApplyXmp(img, xi, 0);
+
+    pos = IndexToPosition(index);
+    for (i = 0; i < XMP_READAHEAD; ++i) {
+        pos = NextPosition(pos);
+        if (pos < 0)
+            break;
+        RequestXmp(PositionToIndex(pos));
+    }
+}
+
+/* How many sidecars are still being read */
+int XmpReadsPending()
+{
+    return sXmpReadsPending;
+}
+
+/* Did img's sidecar give it a rotation? If so, that wins over EXIF. */
+int XmpHasRotation(PhoImage* img)
+{
+    XmpInfo* xi;
+
+    if (!gUseXmp || !sXmpInfo || !img
+        || !(xi = g_hash_table_lookup(sXmpInfo, img->filename)))
+        return 0;
+    return xi->state == XMP_READ && xi->haveRot;
+}
+
+/*************************************
+ * Writing
+ */
+
+static void AppendXmpList(GString* xml, const char* property,
+                          const char* kind, GPtrArray* items)
+{
+    guint i;
+
+    g_string_append_printf(xml, "   <%s>\n    <rdf:%s>\n", property, kind);
+    for (i = 0; i < items->len; ++i) {
+        char* esc = g_markup_escape_text(g_ptr_array_index(items, i), -1);
+        if (!strcmp(kind, "Alt"))
+            g_string_append_printf(xml,
+                              "     <rdf:li xml:lang=\"x-default\">%s</rdf:li>\n",
+                                   esc);
+        else
+            g_string_append_printf(xml, "     <rdf:li>%s</rdf:li>\n", esc);
+        g_free(esc);
+    }
+    g_string_append_printf(xml, "    </rdf:%s>\n   </%s>\n", kind, property);
+}
+
+/* Is keyword in the keywords dialog? If so, it's pho's to manage. */
+static int IsPhoKeyword(const char* keyword)
+{
+    int note;
+
+    for (note = 0; note < NUM_NOTES; ++note) {
+        char* k = KeywordString(note);
+        if (k && !strcmp(k, keyword))
+            return 1;
+    }
+    return 0;
+}
+
+/* The whole sidecar for img, given xi, what was read from it (or 0):
+ * pho's properties, and everything else that was there.
+ * xi is updated to match what's written.
+ */
+static char* XmpPacket(PhoImage* img, XmpInfo* xi)
+{
+    GString* xml = g_string_new("");
+    GPtrArray* keywords = g_ptr_array_new_with_free_func(g_free);
+    GPtrArray* notes = g_ptr_array_new_with_free_func(g_free);
+    int haveRot = (img->trueWidth > 0 || JournalHasRotation(img)
+                   || (xi && xi->haveRot));
+    guint i;
+    int note;
+
+    /* Other programs' keywords are kept */
+    if (xi && xi->subjects)
+        for (i = 0; i < xi->subjects->len; ++i) {
+            char* subject = g_ptr_array_index(xi->subjects, i);
+            if (!IsPhoKeyword(subject))
+                g_ptr_array_add(keywords, g_strdup(subject));
+        }
+
+    for (note = 0; note < NUM_NOTES; ++note) {
+        char* keyword;
+        if (!HasNote(img, note))
+            continue;
+        g_ptr_array_add(notes, g_strdup_printf("%d", note));
+        keyword = KeywordString(note);
+        if (keyword && *keyword)
+            g_ptr_array_add(keywords, g_strdup(keyword));
+    }
+
+    g_string_append(xml,
+        "<?xpacket begin=\"\xef\xbb\xbf\" id=\"W5M0MpCehiHzreSzNTczkc9d\"?>\n"
+        "<x:xmpmeta xmlns:x=\"adobe:ns:meta/\">\n"
+        " <rdf:RDF xmlns:rdf=\"http://www.w3.org/1999/02/22-rdf-syntax-ns#\">\n"
+        "  <rdf:Description");
+    AppendAttribute(xml, " ", "rdf:about", xi && xi->about ? xi->about : "");
+    for (i = 2; i < G_N_ELEMENTS(sXmpNamespaces); ++i)
+        AppendAttribute(xml, "\n    ",
+                        sXmpNamespaces[i][0], sXmpNamespaces[i][1]);
+    if (xi && xi->otherAttrs)
+        g_string_append(xml, xi->otherAttrs->str);
+    if (haveRot)
+        g_string_append_printf(xml, "\n    tiff:Orientation=\"%d\"",
+                               RotToOrientation(img->curRot));
+    g_string_append(xml, ">\n");
+
+    if (keywords->len)
+        AppendXmpList(xml, "dc:subject", "Bag", keywords);
+    if (img->caption && *img->caption) {
+        GPtrArray* caption = g_ptr_array_new();
+        g_ptr_array_add(caption, img->caption);
+        AppendXmpList(xml, "dc:description", "Alt", caption);
+        g_ptr_array_free(caption, TRUE);
+    }
+    if (notes->len)
+        AppendXmpList(xml, "pho:notes", "Bag", notes);
+    if (xi && xi->otherProps)
+        g_string_append(xml, xi->otherProps->str);
+
+    g_string_append(xml,
+        "  </rdf:Description>\n"
+        " </rdf:RDF>\n"
+        "</x:xmpmeta>\n"
+        "<?xpacket end=\"w\"?>\n");
+
+    /* What's cached is what's in the file now */
+    if (xi) {
+        xi->state = XMP_READ;
+        xi->notes = img->notes;
+        if (xi->subjects)
+            g_ptr_array_free(xi->subjects, TRUE);
+        xi->subjects = keywords;
+        keywords = 0;
+        xi->haveRot = haveRot;
+        xi->rot = img->curRot;
+        g_free(xi->caption);
+        xi->caption = g_strdup(img->caption && *img->caption
+                               ? img->caption : 0);
+    }
+
+    if (keywords)
+        g_ptr_array_free(keywords, TRUE);
+    g_ptr_array_free(notes, TRUE);
+    return g_string_free(xml, FALSE);
+}
+
+/* Queue a write of img's sidecar. What's in it has to be read first,
+ * so it isn't lost: if that hasn't happened yet, the write waits for
+ * it, and img stays dirty until then. An image that's no longer in
+ * the list can't wait, so it's only written if its sidecar has been
+ * read already.
+ */
+static void WriteXmp(PhoImage* img)
+{
+    XmpInfo* xi;
+    XmpJob* job;
+    int index;
+
+    /* Its files are going away, unless the delete is undone */
+    if (img->deleted)
+        return;
+
+    xi = (sXmpInfo ? g_hash_table_lookup(sXmpInfo, img->filename) : 0);
+    if (!xi && (index = IndexOfImage(img)) >= 0)
+        xi = RequestXmp(index);
+    if (!xi)
+        return;
+    if (xi->state == XMP_PENDING) {
+        xi->writeWanted = 1;
+        return;
+    }
+
+    /* Writing it would lose what pho couldn't read */
+    if (xi->state == XMP_BAD) {
+        img->xmpDirty = 0;
+        return;
+    }
+
+    img->xmpDirty = 0;
+    job = g_new0(XmpJob, 1);
+    job->path = XmpName(img);
+    job->text = XmpPacket(img, xi);
+    QueueXmpJob(job);
+}
+
+static gboolean FlushXmpWrites(gpointer data)
+{
+    guint i;
+
+    sXmpFlushIdle = 0;
+    for (i = 0; i < sXmpLeftImages->len; ++i) {
+        PhoImage* img = ImageAt(g_array_index(sXmpLeftImages, int, i));
+        if (img && img->xmpDirty && img != gCurImage)
+            WriteXmp(img);
+    }
+    g_array_set_size(sXmpLeftImages, 0);
+    return FALSE;
+}
+
+/* img's notes, caption or rotation have changed */
+void MarkXmpDirty(PhoImage* img)
+{
+    int index;
+
+    if (!gUseXmp || !img || sApplying)
+        return;
+    img->xmpDirty = 1;
+
+    /* Changes can be saved after the image has been left, e.g. by the
+     * keywords dialog a note at a time, so write those once they're
+     * all made, rather than waiting until it's shown again.
+     */
+    if (img == gCurImage || (index = IndexOfImage(img)) < 0)
+        return;
+    if (!sXmpLeftImages)
+        sXmpLeftImages = g_array_new(FALSE, FALSE, sizeof (int));
+    if (sXmpLeftImages->len == 0
+        || g_array_index(sXmpLeftImages, int, sXmpLeftImages->len - 1)
+           != index)
+        g_array_append_val(sXmpLeftImages, index);
+    if (!sXmpFlushIdle)
+        sXmpFlushIdle = g_idle_add(FlushXmpWrites, 0);
+}
+
+/* We're moving from img to another image */
+void LeavingImage(PhoImage* img)
+{
+    if (img && img->xmpDirty)
+        WriteXmp(img);
+}
+
+/* Write every sidecar that needs it, and wait until they're written */
+void FinishXmpWrites()
+{
+    int index, pass;
+
+    if (!gUseXmp)
+        return;
+    if (sXmpFlushIdle) {
+        g_source_remove(sXmpFlushIdle);
+        sXmpFlushIdle = 0;
+        g_array_set_size(sXmpLeftImages, 0);
+    }
+
+    /* Writes waiting on reads go once the reads are in;
+     * the second time round gets any that are left. The reads are
+     * waited for here rather than in the main loop, which would run
+     * key and timer handlers in the middle of exiting.
+     */
+    for (pass = 0; pass < 2; ++pass) {
+        for (index = 0; index < gNumImages; ++index) {
+            PhoImage* img = ImageAt(index);
+            if (img && img->xmpDirty)
+                WriteXmp(img);
+        }
+        while (sXmpReadsPending > 0)
+            XmpReadDone(g_async_queue_pop(sXmpReadsDone));
+    }
+    if (sXmpPool) {
+        g_thread_pool_free(sXmpPool, FALSE, TRUE);
+        sXmpPool = 0;
+    }
+}